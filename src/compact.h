@@ -4,60 +4,213 @@
 #include "fms_index.h"
 #include "parser.h"
 
+// The standard headers used by kmercamel are included first, so that they are not wrapped in its namespace.
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
 // Wrap up kmercamel in a namespace to avoid name conflicts.
 namespace camel {
+#include "kmercamel/src/kmers.h"
+
+/// Compute the reverse complement of the given k-mer like ReverseComplement, which overflows its mask for k-mers filling
+/// the whole word. The bits above the k-mer complement to ones below it, which the shift drops, so no mask is needed.
+inline kmer_t reverse_complement_k_mer(kmer_t k_mer, int k) {
+  return word_reverse_complement(k_mer) >> (KMER_T_SIZE - 2 * k);
+}
+
+// The greedy compaction takes the reverse complements of k-mers of any k up to 32 by the function above.
+#define ReverseComplement(kMer, k) reverse_complement_k_mer(kMer, k)
 #include "kmercamel/src/global.h"
 #include "kmercamel/src/khash_utils.h"
-#include "kmercamel/src/kmers.h"
-KHASH_MAP_INIT_INT64(OCC64, int)
+#undef ReverseComplement
 } // namespace camel
 
-#include <string>
+/// The number of the leading bits of canonical k-mers by which they are distributed to buckets that are sorted independently.
+constexpr int K_MER_BUCKET_BITS = 8;
+/// The number of keys buffered by each thread for each bucket before they are appended to its temporary file.
+constexpr size_t K_MER_BUFFER_SIZE = 1 << 12;
 
-/// Fill in kMers with the represented k-mers in the given superstring under f.
-void count_k_mers(camel::kh_S64_t *k_mers, std::string superstring, std::vector<bool> mask,
-                  int k, demasking_function_t f) {
-  camel::kmer_t k_mer = 0;
-  camel::kmer_t k_mer_mask = 1LL << (2 * k - 1);
-  k_mer_mask |= k_mer_mask - 1;
-  camel::kh_OCC64_t *total_occ = camel::kh_init_OCC64();
-  camel::kh_OCC64_t *ones_occ = camel::kh_init_OCC64();
+/// The inputs concatenated in a superstring, each of which counts a k-mer at most once in count_k_mers.
+struct k_mer_inputs {
+  /// The position in the superstring after the end of each input.
+  std::vector<size_t> ends;
+  /// The number which each input adds to the occurrences of a k-mer it contains and to its ones if it represents it.
+  std::vector<size_t> weights;
+};
 
-  for (int i = 0; i < k - 1; ++i) {
-    k_mer = (k_mer << 2) | camel::NucleotideToInt(superstring[i]);
+/// Sort the [size] keys whose values are below 2^bits by the LSD radix sort with 8-bit digits, using [buffer] of the same size.
+void radix_sort(uint64_t *keys, size_t size, int bits, std::vector<uint64_t> &buffer) {
+  if (size < 256) {
+    std::sort(keys, keys + size);
+    return;
   }
-  for (size_t i = 0; i < superstring.size() - k + 1; ++i) {
-    k_mer = (k_mer << 2) | camel::NucleotideToInt(superstring[i + k - 1]);
-    k_mer &= k_mer_mask;
-    auto canonical_k_mer = std::min(k_mer, camel::ReverseComplement(k_mer, k));
-    int total = 0, ones = 0;
-      int ret;
-    camel::khiter_t it = camel::kh_get_OCC64(total_occ, canonical_k_mer);
-    if (it == kh_end(total_occ)) {
-        it = camel::kh_put_OCC64(total_occ, canonical_k_mer, &ret);
-    } else {
-        total = kh_val(total_occ, it);
+  buffer.resize(size);
+  uint64_t *from = keys, *to = buffer.data();
+  for (int shift = 0; shift < bits; shift += 8) {
+    size_t counts[257] = {0};
+    for (size_t i = 0; i < size; ++i) ++counts[((from[i] >> shift) & 255) + 1];
+    for (int digit = 0; digit < 256; ++digit) counts[digit + 1] += counts[digit];
+    for (size_t i = 0; i < size; ++i) to[counts[(from[i] >> shift) & 255]++] = from[i];
+    std::swap(from, to);
+  }
+  if (from != keys) std::copy(from, from + size, keys);
+}
+
+/// Return the sorted canonical k-mers represented in the superstring with the given mask under f.
+///
+/// Each occurrence of a canonical k-mer becomes a key of its bits below the bucket bits followed by its input and its
+/// mask bit, distributed to the bucket of its leading bits; the positions are processed in parallel chunks.
+/// Each bucket is then radix-sorted, so that the runs of equal k-mers give their numbers of ones and of occurrences.
+/// If [inputs] are given, the occurrences of a k-mer in one input count as a single occurrence of the input's weight,
+/// which is set if any of them is, so that the result is a set operation over the inputs determined by f.
+/// If [temporary_directory] is not empty, the buckets are stored in files there instead of in memory.
+std::vector<camel::kmer_t> count_k_mers(const std::string &superstring, const std::vector<bool> &mask,
+                                        int k, demasking_function_t f, const std::string &temporary_directory = "",
+                                        const k_mer_inputs &inputs = k_mer_inputs()) {
+  if (superstring.size() < (size_t)k) return {};
+  size_t positions = superstring.size() - k + 1;
+  int input_bits = 0;
+  while (inputs.ends.size() > (size_t(1) << input_bits)) ++input_bits;
+  // More buckets leave enough bits of the keys for the inputs.
+  int bucket_bits = std::min(2 * k, std::max(K_MER_BUCKET_BITS, 2 * k + input_bits + 1 - 64));
+  int low_bits = 2 * k - bucket_bits;
+  int key_bits = low_bits + input_bits + 1;
+  size_t buckets = size_t(1) << bucket_bits;
+  camel::kmer_t k_mer_mask = camel::kmer_t(1) << (2 * k - 1);
+  k_mer_mask |= k_mer_mask - 1;
+  size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), positions);
+  auto chunk_start = [&](size_t chunk) { return positions * chunk / threads; };
+
+  // Call [process] with the bucket and the key of each k-mer occurrence in the chunk.
+  auto for_each_key = [&](size_t chunk, auto process) {
+    camel::kmer_t k_mer = 0;
+    size_t start = chunk_start(chunk), end = chunk_start(chunk + 1);
+    uint64_t input = std::upper_bound(inputs.ends.begin(), inputs.ends.end(), start) - inputs.ends.begin();
+    for (int i = 0; i < k - 1; ++i) {
+      k_mer = (k_mer << 2) | camel::NucleotideToInt(superstring[start + i]);
+    }
+    for (size_t i = start; i < end; ++i) {
+      k_mer = (k_mer << 2) | camel::NucleotideToInt(superstring[i + k - 1]);
+      k_mer &= k_mer_mask;
+      auto canonical_k_mer = std::min(k_mer, camel::reverse_complement_k_mer(k_mer, k));
+      size_t bucket = canonical_k_mer >> low_bits;
+      // The k-mers overlapping the end of an input belong to it.
+      while (input < inputs.ends.size() && inputs.ends[input] <= i) ++input;
+      uint64_t low_k_mer = canonical_k_mer & ((camel::kmer_t(1) << low_bits) - 1);
+      process(bucket, (((low_k_mer << input_bits) | (inputs.ends.empty() ? 0 : input)) << 1) | mask[i]);
+    }
+  };
+  auto run_in_parallel = [&](auto work) {
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; ++t) workers.emplace_back(work, t);
+    work(0);
+    for (auto &worker : workers) worker.join();
+  };
+
+  // The keys of the buckets, either as consecutive ranges of [keys] or in the temporary files.
+  std::vector<uint64_t> keys;
+  std::vector<size_t> bucket_starts(buckets + 1, 0);
+  std::string directory;
+  std::vector<std::FILE *> files;
+  if (temporary_directory.empty()) {
+    std::vector<std::vector<size_t>> offsets(threads, std::vector<size_t>(buckets, 0));
+    run_in_parallel([&](size_t chunk) {
+      for_each_key(chunk, [&](size_t bucket, uint64_t) { ++offsets[chunk][bucket]; });
+    });
+    size_t offset = 0;
+    for (size_t bucket = 0; bucket < buckets; ++bucket) {
+      bucket_starts[bucket] = offset;
+      for (size_t chunk = 0; chunk < threads; ++chunk) {
+        std::swap(offsets[chunk][bucket], offset);
+        offset += offsets[chunk][bucket];
+      }
     }
-    kh_value(total_occ, it) = ++total;
-      it = camel::kh_get_OCC64(ones_occ, canonical_k_mer);
-    if (it == kh_end(ones_occ)) {
-        it = camel::kh_put_OCC64(ones_occ, canonical_k_mer, &ret);
-    } else {
-        ones = kh_val(ones_occ, it);
+    bucket_starts[buckets] = offset;
+    keys.resize(positions);
+    run_in_parallel([&](size_t chunk) {
+      for_each_key(chunk, [&](size_t bucket, uint64_t key) { keys[offsets[chunk][bucket]++] = key; });
+    });
+  } else {
+    std::string name_template = temporary_directory + "/fmsi_k_mers.XXXXXX";
+    if (mkdtemp(name_template.data()) == nullptr) {
+      throw std::runtime_error("Cannot create a temporary directory in " + temporary_directory + ".");
     }
-    ones += mask[i];
-    kh_value(ones_occ, it) = ones;
-    bool contained = containsKMer(k_mers, canonical_k_mer, k, true);
-    if (f(ones, total) && !contained) {
-      kh_put_S64(k_mers, canonical_k_mer, &ret);
-    } else if (!f(ones, total) && contained) {
-      eraseKMer(k_mers, canonical_k_mer, k, true);
+    directory = name_template;
+    files.resize(buckets);
+    for (size_t bucket = 0; bucket < buckets; ++bucket) {
+      files[bucket] = std::fopen((directory + "/" + std::to_string(bucket)).c_str(), "w+b");
+      if (files[bucket] == nullptr) throw std::runtime_error("Cannot create a temporary file in " + directory + ".");
     }
+    std::vector<std::mutex> file_mutexes(buckets);
+    run_in_parallel([&](size_t chunk) {
+      std::vector<std::vector<uint64_t>> buffers(buckets);
+      auto flush = [&](size_t bucket) {
+        std::lock_guard<std::mutex> lock(file_mutexes[bucket]);
+        std::fwrite(buffers[bucket].data(), sizeof(uint64_t), buffers[bucket].size(), files[bucket]);
+        buffers[bucket].clear();
+      };
+      for_each_key(chunk, [&](size_t bucket, uint64_t key) {
+        buffers[bucket].push_back(key);
+        if (buffers[bucket].size() == K_MER_BUFFER_SIZE) flush(bucket);
+      });
+      for (size_t bucket = 0; bucket < buckets; ++bucket) flush(bucket);
+    });
   }
 
-  camel::kh_destroy_OCC64(total_occ);
-  camel::kh_destroy_OCC64(ones_occ);
+  // Sort the buckets in parallel and keep the k-mers represented under f.
+  std::vector<std::vector<camel::kmer_t>> represented(buckets);
+  std::atomic<size_t> next_bucket = 0;
+  std::atomic<bool> read_failed = false;
+  run_in_parallel([&](size_t) {
+    std::vector<uint64_t> file_keys, buffer;
+    for (size_t bucket; (bucket = next_bucket++) < buckets;) {
+      uint64_t *bucket_keys = keys.data() + bucket_starts[bucket];
+      size_t size = bucket_starts[bucket + 1] - bucket_starts[bucket];
+      if (!files.empty()) {
+        file_keys.resize(std::ftell(files[bucket]) / sizeof(uint64_t));
+        std::rewind(files[bucket]);
+        read_failed = read_failed || std::fread(file_keys.data(), sizeof(uint64_t), file_keys.size(), files[bucket]) != file_keys.size();
+        std::fclose(files[bucket]);
+        bucket_keys = file_keys.data();
+        size = file_keys.size();
+      }
+      radix_sort(bucket_keys, size, key_bits, buffer);
+      for (size_t i = 0, j; i < size; i = j) {
+        size_t ones = 0, total = 0;
+        for (j = i; j < size && (bucket_keys[j] >> (input_bits + 1)) == (bucket_keys[i] >> (input_bits + 1)); ++j) {
+          if (inputs.ends.empty()) {
+            ones += bucket_keys[j] & 1;
+            ++total;
+          } else if (j + 1 == size || (bucket_keys[j + 1] >> 1) != (bucket_keys[j] >> 1)) {
+            // The set occurrences of the input are sorted last.
+            size_t weight = inputs.weights[(bucket_keys[j] >> 1) & ((uint64_t(1) << input_bits) - 1)];
+            ones += (bucket_keys[j] & 1) * weight;
+            total += weight;
+          }
+        }
+        if (f(ones, total)) {
+          represented[bucket].push_back((camel::kmer_t(bucket) << low_bits) | (bucket_keys[i] >> (input_bits + 1)));
+        }
+      }
+    }
+  });
+  if (!directory.empty()) std::filesystem::remove_all(directory);
+  if (read_failed) throw std::runtime_error("Cannot read the temporary files in " + directory + ".");
+
+  std::vector<camel::kmer_t> k_mers;
+  for (auto &bucket : represented) k_mers.insert(k_mers.end(), bucket.begin(), bucket.end());
+  return k_mers;
 }
 
 /// Return the masked superstring corresponding to the given masked-cased
@@ -74,17 +227,14 @@ std::pair<std::vector<bool>, std::string> separate_mask_and_superstring(std::str
 }
 
 /// Greedily compute a masked superstring with the same represented set as the
-/// input.
-std::string normalize(std::string ms, int k, demasking_function_t f) {
-  camel::kh_S64_t *k_mers = camel::kh_init_S64();
+/// input. If [temporary_directory] is not empty, the k-mers are counted in files there.
+/// If [inputs] are given, the k-mers are counted once per input; see count_k_mers.
+std::string normalize(std::string ms, int k, demasking_function_t f, const std::string &temporary_directory = "",
+                      const k_mer_inputs &inputs = k_mer_inputs()) {
   auto [mask, superstring] = separate_mask_and_superstring(ms);
-  count_k_mers(k_mers, superstring, mask, k, f);
+  // The k-mers are already sorted, so they need no presorting.
+  auto k_mer_vec = count_k_mers(superstring, mask, k, f, temporary_directory, inputs);
   std::stringstream ss;
-  auto k_mer_vec = kMersToVec(k_mers);
-
-  camel::PartialPreSort(k_mer_vec, k);
   camel::Global(k_mer_vec, ss, k, true);
-
-  kh_destroy_S64(k_mers);
   return ss.str();
 }
\ No newline at end of file
@@ -1,7 +1,12 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+#include <cmath>
 #include <filesystem>
+#include <thread>
 #include <sdsl/select_support_mcl.hpp>
 #include <sdsl/bit_vectors.hpp>
 #include <sdsl/rank_support_v5.hpp>
@@ -14,6 +19,17 @@
 
 typedef unsigned char byte;
 
+// The kernels of the backward search, of the streamed queries and of the LF-mapping are compiled for several x86-64
+// levels (baseline, POPCNT, AVX2/BMI2, AVX-512) and the best variant is chosen at startup. They are flattened, so that
+// rank, update_range, the kLCP scans and the sdsl rank_support_v5 routines are inlined into each variant and their
+// popcounts compile to single instructions even in a portable build. The RRR mask is decoded by mask_rank and
+// mask_access, which are kept out of line and compiled once. Other platforms and compilers use a single variant.
+#if defined(FMSI_X86_SIMD) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__)
+#define FMSI_CPU_DISPATCH __attribute__((target_clones("default", "arch=x86-64-v2", "arch=x86-64-v3", "arch=x86-64-v4"), flatten))
+#else
+#define FMSI_CPU_DISPATCH
+#endif
+
 /// A saturating counter that predicts whether the next queried k-mer is from the same strand as MS or from the reverse one.
 struct strand_predictor {
     int score = 0;
@@ -37,6 +53,11 @@ struct strand_predictor {
         previous = forward_query_result > reverse_query_result;
     }
 
+    /// Estimate the rate of wrong predictions from the confidence of the counter.
+    double misprediction_rate() const {
+        return 0.5 * (1 - std::abs(score) / 7.0);
+    }
+
     /// Make prediction conditioned on the result of the previous query.
     bool predict_swap() {
         if (previous != -1 && result_scores[previous] != 0) {
@@ -48,7 +69,97 @@ struct strand_predictor {
     }
 };
 
+/// Strategies to search the consecutive k-mers of a queried sequence.
+enum class query_strategy {
+    /// Search each k-mer separately, first on the strand suggested by the strand predictor.
+    single,
+    /// Obtain the range of each k-mer from the range of the next one using the kLCP array.
+    streaming,
+    /// Search both strands from their first k-mer and skip the k-mers overlapping a substring which does not occur.
+    skipping,
+};
+
+/// A cost model which chooses the query strategy and the chunk length from the running rate of found k-mers.
+/// The costs are estimated per k-mer in the number of backward search steps.
+struct query_planner {
+    /// Exponential moving average of the fraction of found k-mers.
+    double hit_rate = 1.0;
+
+    void log_results(const int64_t* result, size_t count, bool general) {
+        size_t hits = 0;
+        for (size_t i = 0; i < count; ++i) {
+            // Results of general queries only tell whether the k-mer is represented.
+            hits += general ? result[i] == 1 : result[i] >= 0;
+        }
+        // Longer chunks are more reliable evidence.
+        double weight = count / (count + 32.0);
+        hit_rate += weight * ((double)hits / count - hit_rate);
+    }
+
+    /// Choose the strategy with the smallest expected cost among those allowed; [mispredictions] is the expected rate of
+    /// wrongly predicted strands. With the kLCP array, which is loaded only if streaming is asked for, the queries are
+    /// either streamed or skipping, as these two resolve the strands of a chunk alike.
+    query_strategy choose(bool has_klcp, int k, size_t index_size, double mispredictions) const {
+        // A random k-mer which does not occur mismatches after about log_4(index size) characters.
+        double mismatch_depth = std::min((double)k, std::log2((double)index_size) / 2 + 1);
+        double miss_rate = 1 - hit_rate;
+        // A found k-mer is searched on its strand while the other strand mismatches; a missing one is mostly skipped.
+        double skipping = hit_rate * (k + mismatch_depth) + miss_rate * (1 + 2 * mismatch_depth / (k - mismatch_depth + 1));
+        if (has_klcp) {
+            // A found k-mer costs a few rank calls to extend the range; a missing one resets the ranges of both strands.
+            double streaming = hit_rate * 9 + miss_rate * 2 * mismatch_depth;
+            return streaming < skipping ? query_strategy::streaming : query_strategy::skipping;
+        }
+        // A found k-mer is searched on the predicted strand, or after a mismatch on the other one; a missing one on both strands.
+        double single = hit_rate * (k + mispredictions * mismatch_depth) + miss_rate * 2 * mismatch_depth;
+        return single < skipping ? query_strategy::single : query_strategy::skipping;
+    }
+
+    /// The maximum length of the chunks of a record of the given length.
+    /// Short chunks let the strategy change within records with mixed hit rates, while long chunks save the restarts.
+    /// If not [adaptive], the length does not depend on the hit rate.
+    int64_t max_chunk_length(int64_t sequence_length, int k, bool adaptive = true) const {
+        int64_t max_sequence_chunk_length = 400;
+        int64_t mixed_chunk_length = std::max((int64_t)10, std::min(max_sequence_chunk_length, 2*(int64_t)std::sqrt(sequence_length)));
+        if (!adaptive) return k + mixed_chunk_length;
+        double certainty = std::abs(2 * hit_rate - 1);
+        return k + mixed_chunk_length + (int64_t)((max_sequence_chunk_length - mixed_chunk_length) * certainty * certainty);
+    }
+};
+
+/// A direct-mapped cache of the SA ranges of k-mer suffixes, so that searches of recurring k-mers skip their first steps.
+/// It is owned by a single querying thread; a cache without entries is disabled.
+struct suffix_range_cache {
+    struct entry {
+        /// The encoded suffix, or -1 for an empty entry.
+        uint64_t suffix = -1;
+        size_t sa_start = 0, sa_end = 0;
+        /// The position in the suffix at which its range became empty, or -1 if it occurs.
+        int mismatch = -1;
+    };
+    std::vector<entry> entries;
+    int size_log = 0;
+    /// The number of last nucleotides of the k-mers used as the key.
+    int suffix_length = 16;
+    size_t lookups = 0, hits = 0;
+
+    suffix_range_cache() = default;
+
+    suffix_range_cache(int size_log, int suffix_length) : entries(size_t(1) << size_log), size_log(size_log), suffix_length(suffix_length) {}
+
+    entry& find(uint64_t suffix) {
+        // Fibonacci hashing spreads suffixes which differ only in the first nucleotides.
+        return entries[(suffix * 0x9E3779B97F4A7C15ull) >> (64 - size_log)];
+    }
+
+    double hit_rate() const {
+        return lookups ? (double)hits / lookups : 0;
+    }
+};
+
 constexpr int RRR_BLOCK_SIZE = 63;
+/// The distance of the positions of the superstring whose rows are sampled in fms_index::isa_samples.
+constexpr size_t ISA_SAMPLE_DISTANCE = 1 << 16;
 struct fms_index {
     sdsl::bit_vector ac_gt;
     sdsl::rank_support_v5<1> ac_gt_rank;
@@ -61,8 +172,14 @@ struct fms_index {
     std::vector<size_t> counts;
     size_t dollar_position;
     sdsl::bit_vector klcp;
+    /// Optional rows of the suffixes starting at the multiples of ISA_SAMPLE_DISTANCE, which split the superstring
+    /// into segments that are exported independently.
+    sdsl::int_vector<> isa_samples = sdsl::int_vector<>();
     int k;
     strand_predictor predictor = strand_predictor();
+    query_planner planner = query_planner();
+    /// Optional cache of the SA ranges of k-mer suffixes used by get_range_with_pattern.
+    suffix_range_cache* range_cache = nullptr;
 };
 
 inline size_t rank(const fms_index& index, size_t i, byte c) {
@@ -114,42 +231,127 @@ inline void extend_range_with_klcp(const fms_index& index, size_t& i, size_t& j)
     //j = index.klcp_select(rank + 1) + 1;
 }
 
-void get_range_with_pattern(const fms_index& index, size_t &sa_start, size_t &sa_end, char* pattern, int k) {
-    sa_start = 0;
-    sa_end = index.sa_transformed_mask.size();
-    // Find the SA coordinates of the forward pattern.
-    for (int i = k-1; i >= 0 && sa_start != sa_end; --i) {
-        update_range(index, sa_start, sa_end, nucleotideToInt[(uint8_t)pattern[i]]);
+/// Find the SA range of the last [suffix_length] characters of the pattern of length k and store it in the cache.
+/// Return the position in the pattern at which the range became empty, or -1 if the suffix occurs.
+inline int get_range_with_cached_suffix(const fms_index& index, size_t &sa_start, size_t &sa_end, char* pattern, int k, int suffix_length) {
+    auto& cache = *index.range_cache;
+    int first = k - suffix_length;
+    uint64_t suffix = 0;
+    for (int i = first; i < k; ++i) {
+        suffix = (suffix << 2) | nucleotideToInt[(uint8_t)pattern[i]];
+    }
+    auto& entry = cache.find(suffix);
+    cache.lookups++;
+    if (entry.suffix == suffix) {
+        cache.hits++;
+    } else {
+        entry.suffix = suffix;
+        entry.sa_start = 0;
+        entry.sa_end = index.sa_transformed_mask.size();
+        entry.mismatch = -1;
+        for (int i = k - 1; i >= first; --i) {
+            update_range(index, entry.sa_start, entry.sa_end, nucleotideToInt[(uint8_t)pattern[i]]);
+            if (entry.sa_start == entry.sa_end) {
+                entry.mismatch = i - first;
+                break;
+            }
+        }
+    }
+    sa_start = entry.sa_start;
+    sa_end = entry.sa_end;
+    return entry.mismatch < 0 ? -1 : first + entry.mismatch;
+}
+
+/// Find the SA range of the pattern of length k; see get_range_with_pattern.
+/// If K is non-zero, it is the compile-time value of k, which lets the compiler unroll and schedule the search loop.
+template <int K>
+FMSI_CPU_DISPATCH int search_pattern(const fms_index& index, size_t &sa_start, size_t &sa_end, char* pattern, int k) {
+    int searched = 0;
+    if (index.range_cache) {
+        searched = std::min(k, index.range_cache->suffix_length);
+        int mismatch = get_range_with_cached_suffix(index, sa_start, sa_end, pattern, k, searched);
+        if (mismatch >= 0) return mismatch;
+    } else {
+        sa_start = 0;
+        sa_end = index.sa_transformed_mask.size();
+    }
+    if constexpr (K > 0) {
+        // Encode the pattern beforehand so that the search loop only consists of the rank calls.
+        byte encoded[K];
+        for (int i = 0; i < K; ++i) {
+            encoded[i] = nucleotideToInt[(uint8_t)pattern[i]];
+        }
+        for (int i = K-1-searched; i >= 0; --i) {
+            update_range(index, sa_start, sa_end, encoded[i]);
+            if (sa_start == sa_end) return i;
+        }
+    } else {
+        // Find the SA coordinates of the forward pattern.
+        for (int i = k-1-searched; i >= 0; --i) {
+            update_range(index, sa_start, sa_end, nucleotideToInt[(uint8_t)pattern[i]]);
+            if (sa_start == sa_end) return i;
+        }
+    }
+    return -1;
+}
+
+/// Find the SA range of the pattern of length k.
+/// Return the position in the pattern at which the range became empty, or -1 if the pattern occurs.
+/// Only this search is specialized for the common values of k; the query loops around it are compiled once.
+inline int get_range_with_pattern(const fms_index& index, size_t &sa_start, size_t &sa_end, char* pattern, int k) {
+    switch (k) {
+        case 15: return search_pattern<15>(index, sa_start, sa_end, pattern, k);
+        case 21: return search_pattern<21>(index, sa_start, sa_end, pattern, k);
+        case 25: return search_pattern<25>(index, sa_start, sa_end, pattern, k);
+        case 27: return search_pattern<27>(index, sa_start, sa_end, pattern, k);
+        case 31: return search_pattern<31>(index, sa_start, sa_end, pattern, k);
+        case 63: return search_pattern<63>(index, sa_start, sa_end, pattern, k);
+        default: return search_pattern<0>(index, sa_start, sa_end, pattern, k);
     }
 }
 
+// The RRR mask routines gain nothing from the dispatched instruction sets, so they are kept out of line
+// instead of being inlined into the variants of the dispatched kernels.
+__attribute__((noinline)) size_t mask_rank(const fms_index& index, size_t i) {
+    return index.mask_rank(i);
+}
+
+__attribute__((noinline)) bool mask_access(const fms_index& index, size_t i) {
+    return index.sa_transformed_mask[i];
+}
+
+/// Count the set mask bits in the SA range [sa_start, sa_end) using two rank calls, independently of the range width.
+inline size_t count_ones_in_range(const fms_index& index, size_t sa_start, size_t sa_end) {
+    if (sa_start == sa_end) return 0;
+    return mask_rank(index, sa_end) - mask_rank(index, sa_start);
+}
+
 template <bool maximized_ones=false>
 inline int infer_presence(const fms_index& index, size_t sa_start, size_t sa_end) {
     // Separately optimize all-or-nothing and or.
     if constexpr (maximized_ones) {
-        if (sa_start != sa_end) return index.sa_transformed_mask[sa_start];
+        if (sa_start != sa_end) return mask_access(index, sa_start);
         return -1;
     } else {
-        for (size_t i = sa_start; i < sa_end; ++i) {
-            if (index.sa_transformed_mask[i]) {
-                return 1;
-            }
-        }
         if (sa_start == sa_end) {
             return -1;
-        } else {
-            return 0;
         }
+        return count_ones_in_range(index, sa_start, sa_end) > 0;
     }
 }
 
 inline int64_t kmer_order(const fms_index& index, size_t sa_start) {
-    return index.mask_rank(sa_start);
+    return mask_rank(index, sa_start);
 }
 
 inline int64_t kmer_order_if_present(const fms_index& index, size_t sa_start, size_t sa_end) {
-    if (infer_presence<false>(index, sa_start, sa_end) == 1) {
-        return kmer_order(index, sa_start);
+    if (sa_start == sa_end) {
+        return -1;
+    }
+    // The rank at the start of the range is both the order and half of the presence test.
+    int64_t order = kmer_order(index, sa_start);
+    if ((int64_t)mask_rank(index, sa_end) > order) {
+        return order;
     } else {
         return -1;
     }
@@ -171,85 +373,274 @@ int64_t single_query_order(fms_index& index, char* pattern, int k) {
 std::pair<size_t, size_t> single_query_general(fms_index& index, char* pattern, int k) {
     size_t sa_start, sa_end;
     get_range_with_pattern(index, sa_start, sa_end, pattern, k);
-    size_t ones = 0;
-    for (size_t i = sa_start; i < sa_end; ++i) {
-        ones += index.sa_transformed_mask[i];
+    return {count_ones_in_range(index, sa_start, sa_end), sa_end - sa_start};
+}
+
+/// Whether the result of a k-mer cannot be changed by searching the other strand.
+template <bool maximized_ones>
+inline bool is_resolved(int64_t result, bool output_orders) {
+    return (result >= 0 && output_orders) || result == 1 || (result == 0 && maximized_ones);
+}
+
+/// Resolve the result of a k-mer from its two strands: the strand suggested by the strand predictor is taken first and
+/// the other one only if the k-mer is not resolved on it, and the predictor learns from the results.
+/// All query paths but those of chunks queried with the kLCP array, see resolve_chunk_strands, resolve the strands by it,
+/// so that they agree on k-mers found on both strands.
+/// [strand_result] returns the result of the forward strand for false and of the reverse strand for true.
+template <bool maximized_ones, typename strand_result_t>
+inline int64_t resolve_strands(strand_predictor& predictor, bool output_orders, strand_result_t strand_result) {
+    bool should_swap = predictor.predict_swap();
+    int64_t got = strand_result(should_swap);
+    int forward_predictor_result, backward_predictor_result = 0;
+    if (output_orders) {
+        forward_predictor_result = got >= 0 ? 1 : -1;
+    } else {
+        forward_predictor_result = got;
+    }
+    if (!is_resolved<maximized_ones>(got, output_orders)) {
+        got = strand_result(!should_swap);
+        if (output_orders) {
+            backward_predictor_result = got >= 0 ? 1 : -1;
+        } else {
+            backward_predictor_result = got;
+        }
+    }
+    // Update strand predictor.
+    if (should_swap) {
+        std::swap(forward_predictor_result, backward_predictor_result);
+    }
+    predictor.log_result(forward_predictor_result, backward_predictor_result);
+    return got;
+}
+
+/// Write the result of each k-mer of the strand to [result] without using the kLCP array; a failed search lets the strand
+/// skip all k-mers overlapping the substring that does not occur. This makes queries with few found k-mers several times cheaper.
+template <bool maximized_ones>
+void query_strand_skipping(const fms_index& index, char* sequence, size_t sequence_length, int k, bool output_orders, int64_t* result) {
+    size_t first_candidate = 0;
+    for (size_t i = 0; i <= sequence_length - k; ++i) {
+        result[i] = -1;
+        if (i < first_candidate) continue;
+        size_t sa_start, sa_end;
+        int mismatch = get_range_with_pattern(index, sa_start, sa_end, sequence + i, k);
+        if (mismatch >= 0) {
+            // All k-mers starting up to the mismatched character contain the substring which does not occur.
+            first_candidate = i + mismatch + 1;
+        } else if (output_orders) {
+            result[i] = kmer_order_if_present(index, sa_start, sa_end);
+        } else {
+            result[i] = infer_presence<maximized_ones>(index, sa_start, sa_end);
+        }
     }
-    return {ones, sa_end - sa_start};
 }
 
+/// The number of k-mers of the segments in which query_kmers_streaming searches the two strands in lockstep.
+constexpr size_t STREAMING_SEGMENT_LENGTH = 64;
+
+/// Find the SA range of the k-mer starting at [position] of the strand from the range of the k-mer starting after it
+/// using the kLCP array, or search it anew if that range is empty.
+inline void streaming_step(const fms_index& index, char* strand, size_t position, int k, size_t& sa_start, size_t& sa_end) {
+    if (sa_start == sa_end) {
+        get_range_with_pattern(index, sa_start, sa_end, strand + position, k);
+    } else {
+        extend_range_with_klcp(index, sa_start, sa_end);
+        update_range(index, sa_start, sa_end, nucleotideToInt[(uint8_t)strand[position]]);
+    }
+}
+
+/// Write the result of each k-mer to [result]: its order or -1 if [output_orders], and otherwise 1 if it is present.
+///
+/// The strand suggested by the strand predictor is streamed from its last k-mer, and the other strand from its first
+/// k-mer, only at the k-mers not resolved on the first one. To overlap the memory accesses of the two dependent chains
+/// of rank calls, the k-mers are split into segments: the other strand searches the segment which the first strand has
+/// just finished, in lockstep with the first strand searching the next segment. The other strand restarts at each
+/// segment, as it does after every resolved k-mer, and the extended ranges equal the searched ones, so the results are
+/// the same as of searching the strands one after another.
 template <bool maximized_ones = false>
-void query_kmers_streaming(fms_index& index, char* sequence, char* rc_sequence, size_t sequence_length, int k, bool output_orders, std::ostream& of) {
-    std::vector<int64_t> result (sequence_length - k + 1, -1);
+FMSI_CPU_DISPATCH void query_kmers_streaming(fms_index& index, char* sequence, char* rc_sequence, size_t sequence_length, int k, bool output_orders, int64_t* result) {
+    size_t last = sequence_length - k;
+    std::fill(result, result + last + 1, -1);
     // Use saturating counter to ensure that RC strings are visited as forward strings.
     bool should_swap = index.predictor.predict_swap();
     if (should_swap) {
         std::swap(sequence, rc_sequence);
     }
-    // Search on the forward strand.
     int forward_predictor_result = 0, backward_predictor_result = 0;
-    size_t sa_start = -1, sa_end = -1;
-    for (size_t i = 0; i <= sequence_length - k; ++i) {
-        size_t i_back = sequence_length - k - i;
-        if (sa_start == sa_end) {
-            get_range_with_pattern(index, sa_start, sa_end, sequence + i_back, k);
-        } else {
-            extend_range_with_klcp(index, sa_start, sa_end);
-            update_range(index, sa_start, sa_end, nucleotideToInt[(uint8_t)sequence[i_back]]);
-        }
+    size_t sa_start = -1, sa_end = -1, rc_sa_start = -1, rc_sa_end = -1;
+    auto forward_step = [&](size_t i) {
+        streaming_step(index, sequence, i, k, sa_start, sa_end);
         if (output_orders) {
-            result[i_back] = kmer_order_if_present(index, sa_start, sa_end);
-            if (result[i_back] >= 0) forward_predictor_result++;
-            else forward_predictor_result--;
+            result[i] = kmer_order_if_present(index, sa_start, sa_end);
+            forward_predictor_result += result[i] >= 0 ? 1 : -1;
         } else {
-            result[i_back] = infer_presence<maximized_ones>(index, sa_start, sa_end);
-            forward_predictor_result += result[i_back];
+            result[i] = infer_presence<maximized_ones>(index, sa_start, sa_end);
+            forward_predictor_result += result[i];
         }
-    }
-    // Search on the reverse strand.
-    sa_start = sa_end = -1;
-    for (size_t i = 0; i <= sequence_length - k; ++i) {
-        if ((result[i] >= 0 && output_orders) || result[i] == 1 || (result[i] == 0 && maximized_ones)) {
+    };
+    auto backward_step = [&](size_t i) {
+        if (is_resolved<maximized_ones>(result[i], output_orders)) {
             // This position can be skipped for performance.
-            sa_start = sa_end = -1;
-            continue;
-        }
-        size_t i_back = sequence_length - k - i;
-        if (sa_start == sa_end) {
-            get_range_with_pattern(index, sa_start, sa_end, rc_sequence + i_back, k);
-        } else {
-            extend_range_with_klcp(index, sa_start, sa_end);
-            update_range(index, sa_start, sa_end, nucleotideToInt[(uint8_t)rc_sequence[i_back]]);
+            rc_sa_start = rc_sa_end = -1;
+            return;
         }
+        streaming_step(index, rc_sequence, last - i, k, rc_sa_start, rc_sa_end);
         int64_t res;
         if (output_orders) {
-            res = kmer_order_if_present(index, sa_start, sa_end);
-            if (res >= 0) backward_predictor_result ++;
-            else backward_predictor_result--;
+            res = kmer_order_if_present(index, rc_sa_start, rc_sa_end);
+            backward_predictor_result += res >= 0 ? 1 : -1;
         } else {
-            res = infer_presence<maximized_ones>(index, sa_start, sa_end);
+            res = infer_presence<maximized_ones>(index, rc_sa_start, rc_sa_end);
             backward_predictor_result += res;
         }
         result[i] = std::max(result[i], res);
+    };
+    // The segments end at the k-mers [segment_end], [segment_end] - STREAMING_SEGMENT_LENGTH, ... from the last one.
+    size_t segment_end = last + 1, previous_segment_end = last + 1;
+    while (previous_segment_end > 0) {
+        size_t segment_start = segment_end > STREAMING_SEGMENT_LENGTH ? segment_end - STREAMING_SEGMENT_LENGTH : 0;
+        size_t forward_steps = segment_end - segment_start, backward_steps = previous_segment_end - segment_end;
+        rc_sa_start = rc_sa_end = -1;
+        for (size_t j = 0; j < std::max(forward_steps, backward_steps); ++j) {
+            if (j < forward_steps) forward_step(segment_end - 1 - j);
+            if (j < backward_steps) backward_step(segment_end + j);
+        }
+        previous_segment_end = segment_end;
+        segment_end = segment_start;
     }
     // Log the results to the saturating counter for better future performance.
     if (should_swap) {
-        std::reverse(result.begin(), result.end());
+        std::reverse(result, result + last + 1);
         std::swap(forward_predictor_result, backward_predictor_result);
     }
     index.predictor.log_result(forward_predictor_result, backward_predictor_result);
-    
-    for (size_t i = 0; i < result.size(); ++i) {
-        int64_t c = result[i];
-        if (output_orders) {
-            if (i > 0) of << ",";
-            of << c;
+}
+
+/// A maximal part of a query record which is searched by a single call of the query kernels.
+struct query_chunk {
+    /// The offset of the chunk in the sequence of its record.
+    size_t sequence_offset;
+    size_t length;
+    size_t result_offset;
+};
+
+/// Buffers reused by consecutive queries so that they are not allocated for every queried sequence.
+struct query_scratch {
+    std::vector<char> rc_sequence;
+    std::vector<std::pair<size_t, size_t>> forward_ranges, reverse_ranges, occurrences;
+    std::vector<int64_t> reverse_results;
+    std::vector<query_chunk> chunks;
+    std::vector<size_t> kmer_records;
+    suffix_range_cache range_cache;
+};
+
+/// Resolve the results of the k-mers of a chunk from its two strands like query_kmers_streaming: the strand suggested by
+/// the strand predictor is taken for all k-mers, the other one only for those not resolved on it, and the predictor
+/// learns from the sums of the searched results. [result] holds the results of the forward strand and [reverse_results]
+/// those of the reverse strand in its order.
+template <bool maximized_ones>
+void resolve_chunk_strands(strand_predictor& predictor, bool output_orders, int64_t* result, const int64_t* reverse_results, size_t count) {
+    bool should_swap = predictor.predict_swap();
+    int forward_predictor_result = 0, backward_predictor_result = 0;
+    for (size_t i = 0; i < count; ++i) {
+        int64_t got = should_swap ? reverse_results[count - 1 - i] : result[i];
+        forward_predictor_result += output_orders ? (got >= 0 ? 1 : -1) : got;
+        if (!is_resolved<maximized_ones>(got, output_orders)) {
+            int64_t other = should_swap ? result[i] : reverse_results[count - 1 - i];
+            backward_predictor_result += output_orders ? (other >= 0 ? 1 : -1) : other;
+            got = std::max(got, other);
         }
-        else if (c==1) {
-            of << "1";
+        result[i] = got;
+    }
+    if (should_swap) {
+        std::swap(forward_predictor_result, backward_predictor_result);
+    }
+    predictor.log_result(forward_predictor_result, backward_predictor_result);
+}
+
+/// Write the result of each k-mer to [result] like query_kmers_single, but searching each strand by query_strand_skipping
+/// and resolving the strands by resolve_strands afterwards. With the kLCP array, the strands are resolved by
+/// resolve_chunk_strands instead, so that the results do not depend on whether a chunk is skipping or streamed.
+template <bool maximized_ones = false>
+void query_kmers_skipping(fms_index& index, char* sequence, char* rc_sequence, size_t sequence_length, int k, bool has_klcp, bool output_orders, query_scratch& scratch, int64_t* result) {
+    size_t last = sequence_length - k;
+    auto& reverse_results = scratch.reverse_results;
+    reverse_results.resize(last + 1);
+    query_strand_skipping<maximized_ones>(index, sequence, sequence_length, k, output_orders, result);
+    query_strand_skipping<maximized_ones>(index, rc_sequence, sequence_length, k, output_orders, reverse_results.data());
+    if (has_klcp) {
+        resolve_chunk_strands<maximized_ones>(index.predictor, output_orders, result, reverse_results.data(), last + 1);
+        return;
+    }
+    for (size_t i = 0; i <= last; ++i) {
+        result[i] = resolve_strands<maximized_ones>(index.predictor, output_orders, [&](bool reverse) {
+            return reverse ? reverse_results[last - i] : result[i];
+        });
+    }
+}
+
+/// Fill in [ranges] with the SA range of each k-mer of the sequence using the kLCP array.
+FMSI_CPU_DISPATCH void get_ranges_streaming(const fms_index& index, char* sequence, size_t sequence_length, int k, std::vector<std::pair<size_t, size_t>>& ranges) {
+    ranges.resize(sequence_length - k + 1);
+    size_t sa_start = -1, sa_end = -1;
+    for (size_t i = 0; i <= sequence_length - k; ++i) {
+        size_t i_back = sequence_length - k - i;
+        if (sa_start == sa_end) {
+            get_range_with_pattern(index, sa_start, sa_end, sequence + i_back, k);
         } else {
-            of << "0";
+            extend_range_with_klcp(index, sa_start, sa_end);
+            update_range(index, sa_start, sa_end, nucleotideToInt[(uint8_t)sequence[i_back]]);
         }
+        ranges[i_back] = {sa_start, sa_end};
+    }
+}
+
+/// Fill in [ranges] with the SA range of each k-mer of the sequence, skipping the k-mers which overlap a substring that does not occur.
+void get_ranges_skipping(const fms_index& index, char* sequence, size_t sequence_length, int k, std::vector<std::pair<size_t, size_t>>& ranges) {
+    ranges.assign(sequence_length - k + 1, {0, 0});
+    size_t first_candidate = 0;
+    for (size_t i = 0; i <= sequence_length - k; i = std::max(i + 1, first_candidate)) {
+        auto& [sa_start, sa_end] = ranges[i];
+        int mismatch = get_range_with_pattern(index, sa_start, sa_end, sequence + i, k);
+        if (mismatch >= 0) {
+            first_candidate = i + mismatch + 1;
+        }
+    }
+}
+
+/// Fill in [scratch.occurrences] with the number of set and all occurrences of each k-mer of the sequence on both strands.
+/// The ranges are searched using the kLCP array if [streaming] and by skipping k-mers with absent substrings otherwise.
+void count_occurrences(const fms_index& index, char* sequence, char* rc_sequence, size_t sequence_length, int k, bool streaming, query_scratch& scratch) {
+    // Both strands always need to be searched to count all occurrences.
+    auto& forward_ranges = scratch.forward_ranges;
+    auto& reverse_ranges = scratch.reverse_ranges;
+    if (streaming) {
+        get_ranges_streaming(index, sequence, sequence_length, k, forward_ranges);
+        get_ranges_streaming(index, rc_sequence, sequence_length, k, reverse_ranges);
+    } else {
+        get_ranges_skipping(index, sequence, sequence_length, k, forward_ranges);
+        get_ranges_skipping(index, rc_sequence, sequence_length, k, reverse_ranges);
+    }
+    scratch.occurrences.resize(sequence_length - k + 1);
+    for (size_t i = 0; i <= sequence_length - k; ++i) {
+        auto [sa_start, sa_end] = forward_ranges[i];
+        auto [rc_sa_start, rc_sa_end] = reverse_ranges[sequence_length - k - i];
+        size_t ones = count_ones_in_range(index, sa_start, sa_end);
+        size_t total = sa_end - sa_start;
+        // Do not count self complementary k-mers twice; they have the same range on both strands.
+        if (sa_start != rc_sa_start || sa_end != rc_sa_end) {
+            ones += count_ones_in_range(index, rc_sa_start, rc_sa_end);
+            total += rc_sa_end - rc_sa_start;
+        }
+        scratch.occurrences[i] = {ones, total};
+    }
+}
+
+/// For each k-mer write 1 to [result] if it is represented under the demasking function [f] and 0 otherwise; see count_occurrences.
+template <typename demasking_function>
+void query_kmers_ranges_general(fms_index& index, char* sequence, char* rc_sequence, size_t sequence_length, int k, bool streaming, query_scratch& scratch, int64_t* result, demasking_function f) {
+    count_occurrences(index, sequence, rc_sequence, sequence_length, k, streaming, scratch);
+    for (auto [ones, total] : scratch.occurrences) {
+        *result++ = f(ones, total);
     }
 }
 
@@ -259,60 +650,18 @@ enum class query_mode {
     general,
 };
 
-/// For each k-mer output 1 if it is found and 0 otherwise to the [of] stream.
-template <query_mode mode>
-void query_kmers_single(fms_index& index, char* sequence, char* rc_sequence, size_t sequence_length, int k, std::ostream& of, bool output_orders, demasking_function_t f) {
+/// For each k-mer write to [result] its order or -1 if [output_orders], and otherwise 1 if it is found.
+template <query_mode mode, typename demasking_function = demasking_function_t>
+void query_kmers_single(fms_index& index, char* sequence, char* rc_sequence, size_t sequence_length, int k, int64_t* result, bool output_orders, demasking_function f) {
     for (size_t i = 0; i <= sequence_length - k; ++i) {
         char *kmer = sequence + i;
         char *rc_kmer = rc_sequence + (sequence_length - k - i);
-        bool should_swap = index.predictor.predict_swap();
-        if (should_swap) {
-            std::swap(kmer, rc_kmer);
-        }
-        int forward_predictor_result = 0, backward_predictor_result = 0;
         if constexpr (mode != query_mode::general) {
-            int64_t got;
-            if (output_orders) {
-                got = single_query_order(index, kmer, k);
-            } else if constexpr (mode == query_mode::orr) {
-                got = single_query_or<false>(index, kmer, k);
-            } else {
-                got = single_query_or<true>(index, kmer, k);
-            }
-            forward_predictor_result = got;
-            if (output_orders) {
-                if (forward_predictor_result >= 0) forward_predictor_result = 1;
-                else {
-                    got = single_query_order(index, rc_kmer, k);
-                    backward_predictor_result = got >= 0 ? 1 : -1;
-                }
-            } else if constexpr (mode == query_mode::orr) {
-                if (got != 1) {
-                    got = single_query_or<false>(index,rc_kmer , k);
-                    backward_predictor_result = got;
-                }
-            } else {
-                if (got == -1) {
-                    got = single_query_or<true>(index, rc_kmer , k);
-                    backward_predictor_result = got;
-                }
-            }
-            
-            if (output_orders) {
-                if (i > 0) of << ",";
-                of << got;
-            }
-            else if (got == 1) {
-                of << "1";
-            } else {
-                of << "0";
-            }
-
-            // Update strand predictor.
-            if (should_swap) {
-                std::swap(forward_predictor_result, backward_predictor_result);
-            }
-            index.predictor.log_result(forward_predictor_result, backward_predictor_result);
+            result[i] = resolve_strands<mode == query_mode::all>(index.predictor, output_orders, [&](bool reverse) -> int64_t {
+                char* pattern = reverse ? rc_kmer : kmer;
+                if (output_orders) return single_query_order(index, pattern, k);
+                return single_query_or<mode == query_mode::all>(index, pattern, k);
+            });
         } else {
             auto [ones, total] = single_query_general(index, kmer, k);
             // Do not count self complementary k-mers twice.
@@ -321,26 +670,420 @@ void query_kmers_single(fms_index& index, char* sequence, char* rc_sequence, siz
                 ones += ones_rev;
                 total += total_rev;
             }
-            if (f(ones, total)) {
-                of << "1";
-            } else {
-                of << "0";
-            }
+            result[i] = f(ones, total);
         }
     }
 }
 
-template <query_mode mode>
-void query_kmers(fms_index& index, char* sequence, size_t sequence_length, int k, bool has_klcp, std::ostream& of, bool output_orders, demasking_function_t f = nullptr) {
-    char *rc_sequence = ReverseComplementString(sequence, sequence_length);
-    if (has_klcp && mode != query_mode::general) {
-        query_kmers_streaming<mode==query_mode::all>(index, sequence, rc_sequence, sequence_length, k, output_orders, of);
+/// Query all k-mers of the sequence and write to [result] the order of each k-mer or -1 if [output_orders], and otherwise 1 for the represented ones.
+/// For query_mode::general, [f] is the demasking function, preferably a functor so that it gets inlined.
+template <query_mode mode, typename demasking_function = demasking_function_t>
+void query_kmers(fms_index& index, char* sequence, size_t sequence_length, int k, bool has_klcp, bool output_orders, query_scratch& scratch, int64_t* result, demasking_function f = demasking_function()) {
+    scratch.rc_sequence.resize(std::max(scratch.rc_sequence.size(), sequence_length));
+    char *rc_sequence = scratch.rc_sequence.data();
+    ReverseComplement(sequence, rc_sequence, sequence_length);
+    query_strategy strategy = index.planner.choose(has_klcp, k, index.sa_transformed_mask.size(), index.predictor.misprediction_rate());
+    if (strategy == query_strategy::single) {
+        query_kmers_single<mode, demasking_function>(index, sequence, rc_sequence, sequence_length, k, result, output_orders, f);
+    } else if constexpr (mode == query_mode::general) {
+        query_kmers_ranges_general<demasking_function>(index, sequence, rc_sequence, sequence_length, k, strategy == query_strategy::streaming, scratch, result, f);
+    } else if (strategy == query_strategy::streaming) {
+        query_kmers_streaming<mode==query_mode::all>(index, sequence, rc_sequence, sequence_length, k, output_orders, result);
     } else {
-        query_kmers_single<mode>(index, sequence, rc_sequence, sequence_length, k, of, output_orders, f);
+        query_kmers_skipping<mode==query_mode::all>(index, sequence, rc_sequence, sequence_length, k, has_klcp, output_orders, scratch, result);
+    }
+    index.planner.log_results(result, sequence_length - k + 1, mode == query_mode::general);
+}
+
+/// Append the query results to [out]; comma separated orders if [output_orders] and otherwise 1 for found k-mers and 0 for the others.
+inline void append_query_results(std::string& out, const int64_t* result, size_t count, bool output_orders) {
+    if (!output_orders) {
+        for (size_t i = 0; i < count; ++i) {
+            out.push_back(result[i] == 1 ? '1' : '0');
+        }
+        return;
+    }
+    char buffer[24];
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0) out.push_back(',');
+        auto end = std::to_chars(buffer, buffer + sizeof(buffer), result[i]).ptr;
+        out.append(buffer, end);
     }
-    delete[] rc_sequence;
 }
 
+/// Query all k-mers of the sequence and output the results to the [of] stream.
+template <query_mode mode, typename demasking_function = demasking_function_t>
+void query_kmers(fms_index& index, char* sequence, size_t sequence_length, int k, bool has_klcp, std::ostream& of, bool output_orders, demasking_function f = demasking_function()) {
+    query_scratch scratch;
+    std::vector<int64_t> result (sequence_length - k + 1);
+    query_kmers<mode, demasking_function>(index, sequence, sequence_length, k, has_klcp, output_orders, scratch, result.data(), f);
+    std::string out;
+    append_query_results(out, result.data(), result.size(), output_orders);
+    of << out;
+}
+
+/// A block of query records which are searched at once so that the per-call overhead of short records is shared.
+struct query_batch {
+    std::vector<std::string> names;
+    /// The sequence of a record, either borrowed from the caller or copied to [sequences] at [offset].
+    struct record_sequence {
+        const char* borrowed;
+        size_t offset;
+        size_t length;
+    };
+    std::vector<record_sequence> record_sequences;
+    /// Concatenated copied sequences of the records.
+    std::string sequences;
+    /// The total length of the sequences of the records.
+    size_t sequence_length = 0;
+    /// Result of every k-mer of every record; the results of the record i end at result_ends[i].
+    std::vector<int64_t> results;
+    std::vector<size_t> result_ends;
+    /// The number of results of each record if all its k-mers are queried; see query_batch_records.
+    std::vector<size_t> result_counts;
+
+    size_t size() const {
+        return names.size();
+    }
+
+    /// Add a record with a copy of its sequence.
+    void add_record(std::string_view name, const char* sequence, size_t length) {
+        names.emplace_back(name);
+        record_sequences.push_back({nullptr, sequences.size(), length});
+        sequences.append(sequence, length);
+        sequence_length += length;
+    }
+
+    /// Add a record without copying its sequence, which has to outlive the batch, such as a window of a mapped file.
+    void add_borrowed_record(std::string_view name, const char* sequence, size_t length) {
+        names.emplace_back(name);
+        record_sequences.push_back({sequence, 0, length});
+        sequence_length += length;
+    }
+
+    /// The sequence of the record; the queries do not modify it even though they take it as char*.
+    char* sequence(size_t record) const {
+        auto& record_sequence = record_sequences[record];
+        return const_cast<char*>(record_sequence.borrowed ? record_sequence.borrowed : sequences.data() + record_sequence.offset);
+    }
+
+    size_t sequence_size(size_t record) const {
+        return record_sequences[record].length;
+    }
+
+    void clear() {
+        names.clear();
+        record_sequences.clear();
+        sequences.clear();
+        sequence_length = 0;
+        results.clear();
+        result_ends.clear();
+        result_counts.clear();
+    }
+};
+
+/// Split the record of the batch into chunks of at most [max_sequence_chunk_length] characters which are queried at once,
+/// with results stored from [results_offset], and return the number of its results.
+/// Every k-mer with an invalid character has no chunk; its result is meant to be -1, which is output as not found.
+size_t plan_query_chunks(const query_batch& batch, size_t record, int k, int64_t max_sequence_chunk_length, size_t results_offset, std::vector<query_chunk>& chunks) {
+    chunks.clear();
+    size_t position = 0;
+    int64_t sequence_length = batch.sequence_size(record);
+    size_t results_count = 0;
+    while (sequence_length > 0) {
+        int64_t current_length = NextInvalidNucleotide(batch.sequence(record) + position, sequence_length);
+        while (current_length >= k) {
+            int64_t chunk_length = std::min(current_length, max_sequence_chunk_length);
+            chunks.push_back({position, (size_t)chunk_length, results_offset + results_count});
+            results_count += chunk_length - k + 1;
+            position += chunk_length - k + 1;
+            current_length -= chunk_length - k + 1;
+            sequence_length -= chunk_length - k + 1;
+        }
+        // Skip also the next character.
+        sequence_length -= current_length + 1;
+        position += current_length + 1;
+        if (sequence_length >= 0) {
+            results_count += std::min((int64_t) k, current_length + 1);
+        }
+    }
+    return results_count;
+}
+
+/// Whether the record of the batch is a single k-mer without invalid characters which can be searched in bulk.
+inline bool is_kmer_record(const query_batch& batch, size_t record, int k) {
+    return k <= 64 && batch.sequence_size(record) == (size_t)k && NextInvalidNucleotide(batch.sequence(record), k) == (size_t)k;
+}
+
+/// Encode the k-mer (or its reverse complement) with the last nucleotide as the most significant,
+/// so that sorting groups the k-mers with common suffixes, which share the steps of the backward search.
+template <typename kmer_t>
+inline kmer_t encode_kmer_by_suffix(const char* kmer, int k, bool reverse_complement) {
+    kmer_t key = 0;
+    if (reverse_complement) {
+        for (int i = 0; i < k; ++i) {
+            key = (key << 2) | kmer_t(3 - nucleotideToInt[(uint8_t)kmer[i]]);
+        }
+    } else {
+        for (int i = k - 1; i >= 0; --i) {
+            key = (key << 2) | kmer_t(nucleotideToInt[(uint8_t)kmer[i]]);
+        }
+    }
+    return key;
+}
+
+/// The number of common last nucleotides of two k-mers encoded by encode_kmer_by_suffix.
+template <typename kmer_t>
+inline int common_suffix_length(kmer_t a, kmer_t b, int k) {
+    kmer_t difference = a ^ b;
+    if (difference == 0) return k;
+    int leading_zeros;
+    if constexpr (sizeof(kmer_t) > sizeof(uint64_t)) {
+        uint64_t high = uint64_t(difference >> 64);
+        leading_zeros = high ? __builtin_clzll(high) : 64 + __builtin_clzll(uint64_t(difference));
+    } else {
+        leading_zeros = __builtin_clzll(difference);
+    }
+    return (leading_zeros - (8 * (int)sizeof(kmer_t) - 2 * k)) / 2;
+}
+
+/// Fill in [ranges] with the SA range of each of the sorted encoded k-mers, indexed by their ids.
+/// The search of each k-mer continues from the common suffix with the previous one, so duplicates are searched only once.
+template <typename kmer_t>
+FMSI_CPU_DISPATCH void get_ranges_sorted(const fms_index& index, const std::vector<std::pair<kmer_t, uint32_t>>& kmers, int k, std::vector<std::pair<size_t, size_t>>& ranges) {
+    // Ranges of the suffixes of the previous k-mer; only the last one searched can be empty.
+    std::vector<std::pair<size_t, size_t>> suffix_ranges (k + 1);
+    suffix_ranges[0] = {0, index.sa_transformed_mask.size()};
+    int searched = 0;
+    for (size_t i = 0; i < kmers.size(); ++i) {
+        auto [kmer, id] = kmers[i];
+        int depth = i ? std::min(searched, common_suffix_length(kmer, kmers[i - 1].first, k)) : 0;
+        auto [sa_start, sa_end] = suffix_ranges[depth];
+        while (depth < k && sa_start != sa_end) {
+            update_range(index, sa_start, sa_end, byte((kmer >> (2 * (k - 1 - depth))) & 3));
+            suffix_ranges[++depth] = {sa_start, sa_end};
+        }
+        searched = depth;
+        ranges[id] = {sa_start, sa_end};
+    }
+}
+
+/// Query the k-mers of both strands given by their encodings by encode_kmer_by_suffix, the strands of the i-th k-mer with ids
+/// 2i and 2i+1, and store the result of the i-th k-mer to [results][i]; see query_kmers for their meaning.
+/// The k-mers are sorted by their suffixes and searched with shared steps, and the strands are then resolved in the order
+/// of the k-mers by resolve_strands, so that the results are the same as of querying the k-mers one by one.
+template <query_mode mode, typename demasking_function, typename kmer_t>
+void query_sorted_kmers(fms_index& index, std::vector<std::pair<kmer_t, uint32_t>>& kmers, int k, bool output_orders, int64_t* results, demasking_function f) {
+    std::sort(kmers.begin(), kmers.end());
+    std::vector<std::pair<size_t, size_t>> ranges (kmers.size());
+    get_ranges_sorted(index, kmers, k, ranges);
+
+    for (size_t i = 0; i < kmers.size() / 2; ++i) {
+        auto [sa_start, sa_end] = ranges[2 * i];
+        auto [rc_sa_start, rc_sa_end] = ranges[2 * i + 1];
+        int64_t result;
+        if constexpr (mode == query_mode::general) {
+            size_t ones = count_ones_in_range(index, sa_start, sa_end);
+            size_t total = sa_end - sa_start;
+            // Do not count self complementary k-mers twice; they have the same range on both strands.
+            if (sa_start != rc_sa_start || sa_end != rc_sa_end) {
+                ones += count_ones_in_range(index, rc_sa_start, rc_sa_end);
+                total += rc_sa_end - rc_sa_start;
+            }
+            result = f(ones, total);
+        } else {
+            result = resolve_strands<mode == query_mode::all>(index.predictor, output_orders, [&](bool reverse) -> int64_t {
+                auto [start, end] = ranges[2 * i + reverse];
+                if (output_orders) return kmer_order_if_present(index, start, end);
+                return infer_presence<mode == query_mode::all>(index, start, end);
+            });
+        }
+        results[i] = result;
+    }
+}
+
+/// Query the k-mer records of the batch in bulk by query_sorted_kmers and scatter the results back to the records.
+/// The results are the same as of query_kmers.
+template <query_mode mode, typename demasking_function, typename kmer_t>
+void query_kmer_records(fms_index& index, query_batch& batch, const std::vector<size_t>& records, int k, bool output_orders, demasking_function f) {
+    std::vector<std::pair<kmer_t, uint32_t>> kmers (2 * records.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        const char* kmer = batch.sequence(records[i]);
+        kmers[2 * i] = {encode_kmer_by_suffix<kmer_t>(kmer, k, false), 2 * i};
+        kmers[2 * i + 1] = {encode_kmer_by_suffix<kmer_t>(kmer, k, true), 2 * i + 1};
+    }
+    std::vector<int64_t> results (records.size());
+    query_sorted_kmers<mode>(index, kmers, k, output_orders, results.data(), f);
+    for (size_t i = 0; i < records.size(); ++i) {
+        batch.results[batch.result_ends[records[i]] - 1] = results[i];
+    }
+}
+
+/// Convert a k-mer encoded with two bits per nucleotide, A=0, C=1, G=2 and T=3, with the first nucleotide as the most
+/// significant, to the encoding of the k-mer (or its reverse complement) by encode_kmer_by_suffix.
+template <typename kmer_t>
+inline kmer_t reencode_kmer_by_suffix(kmer_t kmer, int k, bool reverse_complement) {
+    kmer_t mask = kmer_t(-1) >> (8 * sizeof(kmer_t) - 2 * k);
+    kmer &= mask;
+    if (reverse_complement) {
+        // The last nucleotide of the reverse complement is the complement of the first one and so on.
+        return kmer ^ mask;
+    }
+    kmer_t key = 0;
+    for (int i = 0; i < k; ++i) {
+        key = (key << 2) | ((kmer >> (2 * i)) & 3);
+    }
+    return key;
+}
+
+/// Query [count] k-mers encoded with two bits per nucleotide as in reencode_kmer_by_suffix and store their results to
+/// [results]; see query_kmers for their meaning. The k-mers are searched in bulk without any conversion to characters.
+/// Requires k <= 4 * sizeof(kmer_t).
+template <query_mode mode, typename demasking_function = demasking_function_t, typename kmer_t>
+void query_encoded_kmers(fms_index& index, const kmer_t* encoded_kmers, size_t count, int k, bool output_orders, int64_t* results,
+                         demasking_function f = demasking_function()) {
+    // Blocks keep the ids of both strands within 32 bits and the memory bounded.
+    constexpr size_t max_block_size = 1 << 24;
+    std::vector<std::pair<kmer_t, uint32_t>> kmers;
+    for (size_t begin = 0; begin < count; begin += max_block_size) {
+        size_t block_size = std::min(max_block_size, count - begin);
+        kmers.resize(2 * block_size);
+        for (size_t i = 0; i < block_size; ++i) {
+            kmers[2 * i] = {reencode_kmer_by_suffix(encoded_kmers[begin + i], k, false), 2 * i};
+            kmers[2 * i + 1] = {reencode_kmer_by_suffix(encoded_kmers[begin + i], k, true), 2 * i + 1};
+        }
+        query_sorted_kmers<mode>(index, kmers, k, output_orders, results + begin, f);
+    }
+}
+
+/// Whether the query result of a k-mer means that it is found; see query_kmers.
+inline bool is_found(int64_t result, bool output_orders) {
+    return output_orders ? result >= 0 : result == 1;
+}
+
+/// Bounds on the fraction of found k-mers of a record and on their number.
+/// The query of a record can stop as soon as it is decided whether its results are within them.
+struct containment_thresholds {
+    double min_fraction = 0, max_fraction = 1;
+    size_t min_found = 0;
+
+    bool enabled() const {
+        return min_fraction > 0 || max_fraction < 1 || min_found > 0;
+    }
+
+    /// The lowest and the highest possible fraction if [found] of the first [queried] of [total] k-mers are found.
+    static std::pair<double, double> fraction_bounds(size_t found, size_t queried, size_t total) {
+        if (total == 0) return {0, 0};
+        return {(double)found / total, (double)(found + total - queried) / total};
+    }
+
+    /// Whether the results are within the bounds for any results of the remaining k-mers.
+    bool satisfied(size_t found, size_t queried, size_t total) const {
+        auto [lowest, highest] = fraction_bounds(found, queried, total);
+        return lowest >= min_fraction && highest <= max_fraction && found >= min_found;
+    }
+
+    /// Whether the results of the remaining k-mers cannot change if the results are within the bounds.
+    bool decided(size_t found, size_t queried, size_t total) const {
+        auto [lowest, highest] = fraction_bounds(found, queried, total);
+        return highest < min_fraction || lowest > max_fraction || found + total - queried < min_found
+            || satisfied(found, queried, total);
+    }
+};
+
+/// Query all records of the batch and fill in their results; see query_kmers for their meaning.
+/// The chunks of each record are planned just before it is queried, so that their length follows the current hit rate.
+/// If all records are single k-mers, they are searched in bulk by query_kmer_records.
+/// If [thresholds] are enabled, the query of a record stops after the chunk at which it is decided whether they are satisfied,
+/// and only the results of the queried prefix of its k-mers are kept.
+template <query_mode mode, typename demasking_function = demasking_function_t>
+void query_batch_records(fms_index& index, query_batch& batch, int k, bool has_klcp, bool output_orders, query_scratch& scratch,
+                         const containment_thresholds& thresholds = containment_thresholds(), demasking_function f = demasking_function()) {
+    batch.results.clear();
+    batch.result_ends.clear();
+    batch.result_counts.clear();
+    scratch.kmer_records.clear();
+    for (size_t record = 0; record < batch.size() && is_kmer_record(batch, record, k); ++record) {
+        scratch.kmer_records.push_back(record);
+    }
+    // Mixed batches are queried in order, as the strand predictor has to see the records in their order.
+    if (scratch.kmer_records.size() == batch.size()) {
+        batch.results.assign(batch.size(), -1);
+        for (size_t record = 0; record < batch.size(); ++record) {
+            batch.result_ends.push_back(record + 1);
+            batch.result_counts.push_back(1);
+        }
+        if (k <= 32) {
+            query_kmer_records<mode, demasking_function, uint64_t>(index, batch, scratch.kmer_records, k, output_orders, f);
+        } else {
+            query_kmer_records<mode, demasking_function, __uint128_t>(index, batch, scratch.kmer_records, k, output_orders, f);
+        }
+        return;
+    }
+    for (size_t record = 0; record < batch.size(); ++record) {
+        size_t sequence_length = batch.sequence_size(record);
+        size_t results_offset = batch.results.size();
+        // Streamed orders of k-mers found on both strands depend on the strand predicted for each chunk, so their chunks stay fixed.
+        int64_t max_chunk_length = index.planner.max_chunk_length(sequence_length, k, !(has_klcp && output_orders));
+        size_t results_count = plan_query_chunks(batch, record, k, max_chunk_length, results_offset, scratch.chunks);
+        batch.results.resize(results_offset + results_count, -1);
+        size_t found = 0, queried_end = results_offset;
+        for (auto& chunk : scratch.chunks) {
+            query_kmers<mode, demasking_function>(index, batch.sequence(record) + chunk.sequence_offset, chunk.length, k, has_klcp,
+                                                     output_orders, scratch, batch.results.data() + chunk.result_offset, f);
+            if (!thresholds.enabled()) continue;
+            // The k-mers before the chunk are either queried or invalid.
+            for (; queried_end < chunk.result_offset + chunk.length - k + 1; ++queried_end) {
+                found += is_found(batch.results[queried_end], output_orders);
+            }
+            if (thresholds.decided(found, queried_end - results_offset, results_count)) {
+                batch.results.resize(queried_end);
+                break;
+            }
+        }
+        batch.result_ends.push_back(batch.results.size());
+        batch.result_counts.push_back(results_count);
+    }
+}
+
+/// The numbers of found, queried and all k-mers of a record and the length of the longest run of consecutive found k-mers.
+struct record_summary {
+    size_t found = 0, queried = 0, total = 0, longest_run = 0;
+};
+
+/// Summarize the results of the first [count] of the [total] k-mers of a record.
+inline record_summary summarize_results(const int64_t* result, size_t count, size_t total, bool output_orders) {
+    record_summary summary;
+    summary.queried = count;
+    summary.total = total;
+    size_t run = 0;
+    for (size_t i = 0; i < count; ++i) {
+        bool found = is_found(result[i], output_orders);
+        summary.found += found;
+        run = found ? run + 1 : 0;
+        summary.longest_run = std::max(summary.longest_run, run);
+    }
+    return summary;
+}
+
+/// An estimate of the fraction of found k-mers of a record from a sample of its k-mers.
+struct containment_estimate {
+    size_t sampled = 0, found = 0;
+
+    double estimate() const {
+        return sampled ? (double)found / sampled : 0;
+    }
+
+    /// The bounds of the 95% Wilson score interval, which stays within [0, 1] also for small samples.
+    std::pair<double, double> confidence_interval() const {
+        if (sampled == 0) return {0, 1};
+        const double z = 1.96;
+        double n = sampled, p = estimate();
+        double center = (p + z * z / (2 * n)) / (1 + z * z / n);
+        double radius = z / (1 + z * z / n) * std::sqrt(p * (1 - p) / n + z * z / (4 * n * n));
+        return {std::max(0.0, center - radius), std::min(1.0, center + radius)};
+    }
+};
 
 template <typename T>
 inline T obtain_kmer(std::vector<T> &kmers, std::string &ms, size_t i, int kmer_sparsity, T mask, int k_minus_1) {
@@ -394,6 +1137,38 @@ qsint_t* convert_superstring(std::string ms) {
     return ret;
 }
 
+/// Fill in the bit vectors of the BWT with the dollar stored as A, their rank supports and the counts.
+void fill_bwt(fms_index& index, const std::vector<byte>& bwt) {
+    index.ac_gt = sdsl::bit_vector(bwt.size());
+    size_t gt_count = 0;
+    for (size_t i = 0; i < bwt.size(); ++i) {
+        bool is_gt = bwt[i] >= 2;
+        gt_count += is_gt;
+        index.ac_gt[i] = is_gt;
+    }
+    size_t ac_count = bwt.size() - gt_count;
+    index.ac = sdsl::bit_vector(ac_count);
+    index.gt = sdsl::bit_vector(gt_count);
+    size_t a_count = 0;
+    size_t g_count = 0;
+    size_t ac_index = 0;
+    size_t gt_index = 0;
+    for (size_t i = 0; i < bwt.size(); ++i) {
+        bool is_one = bwt[i] & 1;
+        if (index.ac_gt[i] == 0) {
+            index.ac[ac_index++] = is_one;
+            a_count += !is_one;
+        } else {
+            index.gt[gt_index++] = is_one;
+            g_count += !is_one;
+        }
+    }
+    index.counts = {1, a_count, ac_count, ac_count + g_count};
+    index.ac_gt_rank = sdsl::rank_support_v5<1>(&index.ac_gt);
+    index.ac_rank = sdsl::rank_support_v5<1>(&index.ac);
+    index.gt_rank = sdsl::rank_support_v5<1>(&index.gt);
+}
+
 template <typename T>
 fms_index construct(std::string &ms, int k, bool use_klcp) {
     qsint_t *qms = convert_superstring(ms);
@@ -410,6 +1185,7 @@ fms_index construct(std::string &ms, int k, bool use_klcp) {
 
     sdsl::bit_vector sa_transformed_mask(ms.size() + 1);
     std::vector<byte> bwt (ms.size() + 1);
+    index.isa_samples = sdsl::int_vector<>((ms.size() + ISA_SAMPLE_DISTANCE - 1) / ISA_SAMPLE_DISTANCE, 0, sdsl::bits::hi(ms.size() + 1) + 1);
     for (size_t i = 0; i <= ms.size(); ++i) {
         if (sa[i] == 0) {
             index.dollar_position = i;
@@ -418,40 +1194,16 @@ fms_index construct(std::string &ms, int k, bool use_klcp) {
         }
         if (sa[i] != (qsint_t)ms.size()) {
             sa_transformed_mask[i] = is_upper(ms[sa[i]]);
+            if (sa[i] % ISA_SAMPLE_DISTANCE == 0) {
+                index.isa_samples[sa[i] / ISA_SAMPLE_DISTANCE] = i;
+            }
         }
     }
     delete[] sa;
     index.sa_transformed_mask = sdsl::rrr_vector<RRR_BLOCK_SIZE>(sa_transformed_mask);
     sa_transformed_mask.resize(0);
 
-    index.ac_gt = sdsl::bit_vector(bwt.size());
-    size_t gt_count = 0;
-    for (size_t i = 0; i < bwt.size(); ++i) {
-        bool is_gt = bwt[i] >= 2;
-        gt_count += is_gt;
-        index.ac_gt[i] = is_gt;
-    }
-    size_t ac_count = bwt.size() - gt_count;
-    index.ac = sdsl::bit_vector(ac_count);
-    index.gt = sdsl::bit_vector(gt_count);
-    size_t a_count = 0;
-    size_t g_count = 0;
-    size_t ac_index = 0;
-    size_t gt_index = 0;
-    for (size_t i = 0; i < bwt.size(); ++i) {
-        bool is_one = bwt[i] & 1;
-        if (index.ac_gt[i] == 0) {
-            index.ac[ac_index++] = is_one;
-            a_count += !is_one;
-        } else {
-            index.gt[gt_index++] = is_one;
-            g_count += !is_one;
-        }
-    }
-    index.counts = {1, a_count, ac_count, ac_count + g_count};
-    index.ac_gt_rank = sdsl::rank_support_v5<1>(&index.ac_gt);
-    index.ac_rank = sdsl::rank_support_v5<1>(&index.ac);
-    index.gt_rank = sdsl::rank_support_v5<1>(&index.gt);
+    fill_bwt(index, bwt);
     index.mask_rank = sdsl::rank_support_rrr<1, RRR_BLOCK_SIZE>(&index.sa_transformed_mask);
 
     index.k = k;
@@ -459,25 +1211,377 @@ fms_index construct(std::string &ms, int k, bool use_klcp) {
     return index;
 }
 
+/// Whether the index has the row of every sampled position of its superstring.
+inline bool has_isa_samples(const fms_index& index) {
+    size_t length = index.sa_transformed_mask.size() - 1;
+    return index.isa_samples.size() > 0 && index.isa_samples.size() == (length + ISA_SAMPLE_DISTANCE - 1) / ISA_SAMPLE_DISTANCE;
+}
+
+/// Write the masked letters of the segments [first, last) of the superstring of length [length] split at the multiples
+/// of [distance] to [ret], each by the LF-mapping from the row of its end, with the SA-transformed mask decompressed
+/// to [mask]. Several segments are walked at once, so that the cache misses of their independent chains overlap.
+FMSI_CPU_DISPATCH void export_segments(const fms_index& index, const sdsl::bit_vector& mask, char* ret, size_t length, size_t distance, size_t first, size_t last) {
+    const char* masked_letters = "acgtACGT";
+    constexpr size_t lanes = 8;
+    size_t rows[lanes], positions[lanes], starts[lanes];
+    for (size_t segment = first; segment < last; segment += lanes) {
+        size_t count = std::min(lanes, last - segment);
+        for (size_t lane = 0; lane < count; ++lane) {
+            starts[lane] = (segment + lane) * distance;
+            positions[lane] = std::min(starts[lane] + distance, length);
+            // The empty suffix at the end of the superstring is the first row.
+            rows[lane] = positions[lane] == length ? 0 : index.isa_samples[segment + lane + 1];
+        }
+        for (bool active = true; active;) {
+            active = false;
+            for (size_t lane = 0; lane < count; ++lane) {
+                if (positions[lane] == starts[lane]) continue;
+                active = true;
+                byte letter = access(index, rows[lane]);
+                rows[lane] = index.counts[letter] + rank(index, rows[lane], letter);
+                ret[--positions[lane]] = masked_letters[letter + (mask[rows[lane]] << 2)];
+                // Request the words of the next row of the lane while the other lanes are walked.
+                __builtin_prefetch(index.ac_gt.data() + (rows[lane] >> 6));
+                __builtin_prefetch(mask.data() + (rows[lane] >> 6));
+            }
+        }
+    }
+}
+
+/// Export the masked superstring of the index. With the sampled rows, its segments are exported in parallel threads.
+/// The mask is decompressed sequentially first, as accessing the RRR vector at random rows dominates the LF-mapping.
 std::string export_ms(const fms_index& index) {
-    std::string masked_letters = "acgtACGT";
-    std::vector<char> ret(index.sa_transformed_mask.size() - 1);
+    size_t length = index.sa_transformed_mask.size() - 1;
+    std::string ret(length, 0);
+    if (length == 0) return ret;
+    sdsl::bit_vector mask(length + 1);
+    for (size_t i = 0; i <= length; i += 64) {
+        size_t width = std::min<size_t>(64, length + 1 - i);
+        mask.set_int(i, index.sa_transformed_mask.get_int(i, width), width);
+    }
+    size_t distance = has_isa_samples(index) ? ISA_SAMPLE_DISTANCE : length;
+    size_t segments = (length + distance - 1) / distance;
+    size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), segments);
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(export_segments, std::cref(index), std::cref(mask), ret.data(), length, distance, segments * i / threads, segments * (i + 1) / threads);
+    }
+    export_segments(index, mask, ret.data(), length, distance, 0, segments / threads);
+    for (auto& worker : workers) worker.join();
+    return ret;
+}
+
+/// Construct the index of the concatenation of the masked superstrings of the indexes.
+template <typename kmer_t>
+fms_index construct_concatenation(const fms_index& a, const fms_index& b) {
+    std::string merged = export_ms(a) + export_ms(b);
+    return construct<kmer_t>(merged, a.k, a.klcp.size() > 0);
+}
+
+/// A suffix of the superstring of the first merged index which is shorter than k-1, so that its (k-1)-mer in the
+/// concatenation continues into the superstring of the second index.
+template <typename kmer_t>
+struct short_merged_suffix {
+    size_t row;
+    kmer_t code;
+    /// Whether the concatenation has k-1 characters from the suffix on.
+    bool has_kmer;
+    /// The rows of the first index whose (k-1)-mer is the code.
+    size_t sa_start, sa_end;
+};
+
+/// The placement of the rows of two indexes a and b in the index of the concatenation of their superstrings.
+template <typename kmer_t>
+struct merged_order {
+    /// The number of suffixes of b smaller than each suffix of a, by rows of a.
+    sdsl::int_vector<> b_ranks;
+    /// The rows of a which are not in the order of a, with their positions among the suffixes of a, sorted.
+    std::vector<std::pair<size_t, size_t>> moved_rows;
+    /// Whether the suffix of a has the same (k-1)-mer as the preceding or the following suffix of b.
+    sdsl::bit_vector shares_previous, shares_next;
+    std::vector<short_merged_suffix<kmer_t>> short_suffixes;
+    /// The last character of the superstring of a, which precedes the superstring of b.
+    byte last_character;
+    /// The rows of a and of b of the suffixes starting at the sampled positions of the concatenation, with the indices
+    /// of their samples, sorted by rows.
+    std::vector<std::pair<size_t, size_t>> a_samples, b_samples;
+};
+
+/// Find where the rows of the index [b] and of the index [a] are in the index of the concatenation of their masked
+/// superstrings, directly from their BWTs, without exporting or sorting the superstrings.
+///
+/// The suffixes of b keep their order, and each suffix of a is placed after the number of the suffixes of b smaller
+/// than it, which is obtained by the backward search of the superstring of a in b. The suffixes of a keep their order
+/// from a, except those which are prefixes of other suffixes of a; these depend on the superstring of b which follows
+/// them and are moved to positions counted by another backward search in a.
+/// The kLCP bits of suffixes of a next to suffixes of b are obtained by comparing their (k-1)-mers, which are kept only
+/// for the suffixes of b next to suffixes of a, so that the memory does not grow with b beyond a bit per suffix.
+/// Return false if the suffixes to be moved have too many borders or exceptions, as in periodic superstrings.
+template <typename kmer_t>
+bool order_merged_rows(const fms_index& a, const fms_index& b, merged_order<kmer_t>& order) {
+    size_t a_length = a.sa_transformed_mask.size() - 1, b_length = b.sa_transformed_mask.size() - 1;
+    int k = a.k;
+    bool use_klcp = a.klcp.size() > 0;
+    size_t kmer_length = k - 1;
+    int first_shift = 2 * (k - 2);
+
+    auto& b_ranks = order.b_ranks;
+    b_ranks = sdsl::int_vector<>(a_length + 1, 0, sdsl::bits::hi(b_length + 1) + 1);
+    // The rows and the first characters of the suffixes of a which are prefixes of other suffixes, from the shortest.
+    std::vector<size_t> repeated_rows;
+    std::vector<byte> repeated_characters;
+    size_t repeated_start = 0, repeated_end = a_length + 1;
+    order.last_character = access(a, 0);
+    for (size_t i = a_length, row = 0, b_row = b.dollar_position; i-- > 0;) {
+        byte c = access(a, row);
+        row = a.counts[c] + rank(a, row, c);
+        b_row = b.counts[c] + rank(b, b_row, c);
+        b_ranks[row] = b_row;
+        if (i % ISA_SAMPLE_DISTANCE == 0) {
+            order.a_samples.emplace_back(row, i / ISA_SAMPLE_DISTANCE);
+        }
+        if (repeated_end - repeated_start > 1) {
+            update_range(a, repeated_start, repeated_end, c);
+            if (repeated_end - repeated_start > 1) {
+                repeated_rows.push_back(row);
+                repeated_characters.push_back(c);
+            }
+        }
+    }
+
+    // The (k-1)-mers of the rows of b next to a suffix of a, by their ranks among these rows, or no_kmer for suffixes
+    // shorter than k-1; the first characters of b are left in [code] to continue the (k-1)-mers of a.
+    const kmer_t no_kmer = ~kmer_t(0);
+    sdsl::bit_vector is_next_to_a;
+    sdsl::rank_support_v5<1> next_to_a_rank;
+    std::vector<kmer_t> b_codes;
+    if (use_klcp) {
+        is_next_to_a = sdsl::bit_vector(b_length + 1, 0);
+        for (size_t row = 1; row <= a_length; ++row) {
+            is_next_to_a[b_ranks[row] - 1] = 1;
+            if (b_ranks[row] <= b_length) is_next_to_a[b_ranks[row]] = 1;
+        }
+        next_to_a_rank = sdsl::rank_support_v5<1>(&is_next_to_a);
+        b_codes.assign(next_to_a_rank(b_length + 1), no_kmer);
+    }
+    kmer_t code = 0;
+    for (size_t i = b_length, row = 0; i-- > 0;) {
+        byte c = access(b, row);
+        row = b.counts[c] + rank(b, row, c);
+        if ((a_length + i) % ISA_SAMPLE_DISTANCE == 0) {
+            order.b_samples.emplace_back(row, (a_length + i) / ISA_SAMPLE_DISTANCE);
+        }
+        if (use_klcp) {
+            code = ((kmer_t)c << first_shift) | (code >> 2);
+            if (b_length - i >= kmer_length && is_next_to_a[row]) {
+                b_codes[next_to_a_rank(row)] = code;
+            }
+        }
+    }
+
+    auto& shares_previous = order.shares_previous;
+    auto& shares_next = order.shares_next;
+    if (use_klcp) {
+        shares_previous = sdsl::bit_vector(a_length + 1, 0);
+        shares_next = sdsl::bit_vector(a_length + 1, 0);
+        auto b_code = [&](size_t b_row) { return b_codes[next_to_a_rank(b_row)]; };
+        for (size_t i = a_length, row = 0; i-- > 0;) {
+            byte c = access(a, row);
+            row = a.counts[c] + rank(a, row, c);
+            code = ((kmer_t)c << first_shift) | (code >> 2);
+            size_t b_row = b_ranks[row];
+            bool has_kmer = a_length - i + b_length >= kmer_length;
+            if (has_kmer) {
+                shares_previous[row] = b_code(b_row - 1) == code;
+                shares_next[row] = b_row <= b_length && b_code(b_row) == code;
+            }
+            if (a_length - i < kmer_length) {
+                short_merged_suffix<kmer_t> suffix {row, code, has_kmer, 0, a_length + 1};
+                for (int j = k - 2; j >= 0; --j) {
+                    update_range(a, suffix.sa_start, suffix.sa_end, (code >> (2 * (k - 2 - j))) & 3);
+                }
+                order.short_suffixes.push_back(suffix);
+            }
+        }
+        b_codes.clear();
+        b_codes.shrink_to_fit();
+    }
 
-    for (size_t i = 0, bw_index = 0; i < index.sa_transformed_mask.size() - 1; ++i) {
-        byte letter = access(index, bw_index);
-        bw_index = index.counts[letter] + rank(index, bw_index, letter);
-        ret[index.sa_transformed_mask.size() - 2 - i] = masked_letters[letter + (index.sa_transformed_mask[bw_index] << 2)];
+    // A suffix of a is below if it is smaller than the whole superstring of b in the concatenation. These are the rows
+    // of a smaller than the superstring of b, except the suffixes which are prefixes of b, given here as exceptions.
+    auto is_below = [&](size_t row) { return b_ranks[row] <= b.dollar_position; };
+    size_t below_end = a_length;
+    while (below_end > 0 && !is_below(below_end)) --below_end;
+    ++below_end;
+    std::vector<size_t> exceptions;
+    for (size_t row = 1; row < below_end; ++row) {
+        if (!is_below(row)) exceptions.push_back(row);
     }
 
-    return {ret.begin(), ret.end()};
+    // A repeated suffix Y of a is preceded by the suffixes of a which precede it in a, except its borders whose
+    // occurrence at the start of Y is followed by a below suffix, and by the other occurrences of Y which are followed
+    // by a below suffix; the last are counted by the backward search of Y from the below rows.
+    auto& moved_rows = order.moved_rows;
+    size_t steps_left = a_length + b_length;
+    std::vector<size_t> failure(repeated_rows.size() + 1, 0);
+    size_t occurrences_start = 0, occurrences_end = below_end;
+    for (size_t length = 1; length <= repeated_rows.size(); ++length) {
+        byte c = repeated_characters[length - 1];
+        update_range(a, occurrences_start, occurrences_end, c);
+        // The occurrence at the end of a is not followed by a suffix of a.
+        size_t occurrences = occurrences_end - occurrences_start - 1;
+        for (auto& row : exceptions) {
+            if (row == SIZE_MAX) continue;
+            if (steps_left-- == 0) return false;
+            if (row != a.dollar_position && access(a, row) == c) {
+                row = a.counts[c] + rank(a, row, c);
+                --occurrences;
+            } else {
+                row = SIZE_MAX;
+            }
+        }
+        // The borders of Y are the borders of the reverse of Y, which is the prefix of the repeated characters.
+        if (length > 1) {
+            size_t border = failure[length - 1];
+            while (border > 0 && repeated_characters[border] != c) border = failure[border];
+            failure[length] = border + (repeated_characters[border] == c);
+        }
+        size_t borders_before_below = 0;
+        for (size_t border = failure[length]; border > 0; border = failure[border]) {
+            if (steps_left-- == 0) return false;
+            borders_before_below += is_below(repeated_rows[length - border - 1]);
+        }
+        size_t row = repeated_rows[length - 1];
+        moved_rows.emplace_back(row - 1 - borders_before_below + occurrences, row);
+    }
+    std::sort(moved_rows.begin(), moved_rows.end());
+    std::sort(order.a_samples.begin(), order.a_samples.end());
+    std::sort(order.b_samples.begin(), order.b_samples.end());
+    return true;
 }
 
+/// Build the index of the concatenation of the masked superstrings of the indexes [a] and [b] from the placement of their rows.
+/// The kLCP bits of neighbouring suffixes from the same index are taken from its kLCP array.
+template <typename kmer_t>
+fms_index build_merged_index(const fms_index& a, const fms_index& b, const merged_order<kmer_t>& order) {
+    size_t a_length = a.sa_transformed_mask.size() - 1, b_length = b.sa_transformed_mask.size() - 1;
+    bool use_klcp = a.klcp.size() > 0;
+    auto& b_ranks = order.b_ranks;
+    auto& moved_rows = order.moved_rows;
+    auto& short_suffixes = order.short_suffixes;
+    sdsl::bit_vector is_moved(a_length + 1, 0);
+    for (auto [_, row] : moved_rows) is_moved[row] = 1;
+    sdsl::bit_vector is_a_sample(a_length + 1, 0);
+    for (auto [row, _] : order.a_samples) is_a_sample[row] = 1;
+
+    sdsl::rank_support_v5<1> a_klcp_rank;
+    sdsl::bit_vector is_short;
+    if (use_klcp) {
+        a_klcp_rank = sdsl::rank_support_v5<1>(&a.klcp);
+        is_short = sdsl::bit_vector(a_length + 1, 0);
+        for (auto& suffix : short_suffixes) is_short[suffix.row] = 1;
+    }
+    auto find_short = [&](size_t row) {
+        return *std::find_if(short_suffixes.begin(), short_suffixes.end(), [&](auto& suffix) { return suffix.row == row; });
+    };
+    // Whether the consecutive suffixes of a given by their rows in a have the same (k-1)-mer in the concatenation.
+    auto a_rows_share = [&](size_t first, size_t second) {
+        if (is_short[first] || is_short[second]) {
+            if (!is_short[first]) std::swap(first, second);
+            auto suffix = find_short(first);
+            if (!suffix.has_kmer) return false;
+            if (!is_short[second]) return suffix.sa_start <= second && second < suffix.sa_end;
+            auto other = find_short(second);
+            return other.has_kmer && other.code == suffix.code;
+        }
+        size_t start = std::min(first, second), end = std::max(first, second);
+        return a_klcp_rank(end) - a_klcp_rank(start) == end - start;
+    };
+
+    fms_index index;
+    size_t size = a_length + b_length + 1;
+    std::vector<byte> bwt(size);
+    sdsl::bit_vector sa_transformed_mask(size, 0);
+    if (use_klcp) {
+        index.klcp = sdsl::bit_vector(size, 0);
+    }
+    index.isa_samples = sdsl::int_vector<>((size - 1 + ISA_SAMPLE_DISTANCE - 1) / ISA_SAMPLE_DISTANCE, 0, sdsl::bits::hi(size) + 1);
+    size_t position = 0;
+    bool previous_from_a = false;
+    size_t previous_row = 0;
+    size_t next_b_sample = 0;
+    auto append_b_row = [&](size_t row) {
+        if (next_b_sample < order.b_samples.size() && order.b_samples[next_b_sample].first == row) {
+            index.isa_samples[order.b_samples[next_b_sample++].second] = position;
+        }
+        bwt[position] = row == b.dollar_position ? order.last_character : access(b, row);
+        sa_transformed_mask[position] = mask_access(b, row);
+        if (use_klcp && position > 0) {
+            index.klcp[position - 1] = previous_from_a ? order.shares_next[previous_row] : b.klcp[row - 1];
+        }
+        previous_from_a = false;
+        previous_row = row;
+        ++position;
+    };
+    auto append_a_row = [&](size_t row) {
+        if (is_a_sample[row]) {
+            auto sample = std::lower_bound(order.a_samples.begin(), order.a_samples.end(), std::make_pair(row, (size_t)0));
+            index.isa_samples[sample->second] = position;
+        }
+        if (row == a.dollar_position) {
+            index.dollar_position = position;
+        } else {
+            bwt[position] = access(a, row);
+        }
+        sa_transformed_mask[position] = mask_access(a, row);
+        if (use_klcp) {
+            index.klcp[position - 1] = previous_from_a ? a_rows_share(previous_row, row) : order.shares_previous[row];
+        }
+        previous_from_a = true;
+        previous_row = row;
+        ++position;
+    };
+    size_t b_row = 0;
+    for (size_t i = 0, next_row = 1, next_moved = 0; i < a_length; ++i) {
+        size_t row;
+        if (next_moved < moved_rows.size() && moved_rows[next_moved].first == i) {
+            row = moved_rows[next_moved++].second;
+        } else {
+            while (is_moved[next_row]) ++next_row;
+            row = next_row++;
+        }
+        while (b_row < b_ranks[row]) append_b_row(b_row++);
+        append_a_row(row);
+    }
+    while (b_row <= b_length) append_b_row(b_row++);
+
+    index.sa_transformed_mask = sdsl::rrr_vector<RRR_BLOCK_SIZE>(sa_transformed_mask);
+    sa_transformed_mask.resize(0);
+    fill_bwt(index, bwt);
+    index.mask_rank = sdsl::rank_support_rrr<1, RRR_BLOCK_SIZE>(&index.sa_transformed_mask);
+    index.k = a.k;
+    return index;
+}
+
+/// Merge the index [b] after the index [a] directly from their BWTs by order_merged_rows and build_merged_index.
+/// If a superstring is empty, only a has a kLCP array, or the rows cannot be ordered cheaply, the index is constructed
+/// from the concatenation instead.
+template <typename kmer_t>
+fms_index merge_bwts(const fms_index& a, const fms_index& b) {
+    merged_order<kmer_t> order;
+    if (a.sa_transformed_mask.size() == 1 || b.sa_transformed_mask.size() == 1 || a.k < 2 || (a.klcp.size() > 0 && b.klcp.size() == 0)
+            || !order_merged_rows(a, b, order)) {
+        return construct_concatenation<kmer_t>(a, b);
+    }
+    return build_merged_index(a, b, order);
+}
+
+/// Merge the index [b] after the index [a], so that it is the index of the concatenation of their masked superstrings.
 fms_index merge(const fms_index& a, const fms_index& b) {
-    std::string merged = export_ms(a) + export_ms(b);
-    if (a.k <= 32)  {
-        return construct<uint64_t>(merged, a.k, a.klcp.size() > 0);
+    if (a.k <= 32) {
+        return merge_bwts<uint64_t>(a, b);
     } else {
-        return construct<__uint128_t>(merged, a.k, a.klcp.size() > 0);
+        return merge_bwts<__uint128_t>(a, b);
     }
 }
 
@@ -490,6 +1594,11 @@ void dump_index(const fms_index& index, const std::string &fn) {
     if (index.klcp.size() > 0) {
         sdsl::store_to_file(index.klcp, basename + ".klcp");
     }
+    if (has_isa_samples(index)) {
+        sdsl::store_to_file(index.isa_samples, basename + ".isa");
+    } else {
+        std::filesystem::remove(basename + ".isa");
+    }
     std::ofstream out(basename + ".misc");
     out << index.dollar_position << std::endl;
     for (auto c : index.counts) {
@@ -513,6 +1622,9 @@ fms_index load_index(const std::string &fn, bool use_klcp = true) {
     if (std::filesystem::exists(basename + ".klcp") && use_klcp) {
         sdsl::load_from_file(index.klcp, basename + ".klcp");
     }
+    if (std::filesystem::exists(basename + ".isa")) {
+        sdsl::load_from_file(index.isa_samples, basename + ".isa");
+    }
     std::ifstream in(basename + ".misc");
     in >> index.dollar_position;
     for (size_t i = 0; i < 4; ++i) {
@@ -18,6 +18,44 @@ bool f_r_to_s(size_t ones, [[maybe_unused]] size_t total, size_t r, size_t s) {
   return ones <= s && ones >= r;
 }
 
+/// Functor counterparts of the demasking functions which can be inlined when used as template parameters.
+struct or_functor {
+  bool operator()(size_t ones, size_t total) const { return f_or(ones, total); }
+};
+struct and_functor {
+  bool operator()(size_t ones, size_t total) const { return f_and(ones, total); }
+};
+struct xor_functor {
+  bool operator()(size_t ones, size_t total) const { return f_xor(ones, total); }
+};
+struct r_to_s_functor {
+  size_t r, s;
+  bool operator()(size_t ones, size_t total) const { return f_r_to_s(ones, total, r, s); }
+};
+
+/// Parse the r and s of a function named INT-INT; return false if the name is not of this form.
+bool parse_r_to_s(const std::string &name, size_t &r, size_t &s) {
+  for (size_t i = 1; i + 1 < name.size(); ++i) {
+    if (name[i] == '-') {
+      std::string r_string = name.substr(0, i),
+                  s_string = name.substr(i + 1, name.size() - i - 1);
+      bool valid = true;
+      for (size_t j = 0; j < r_string.size(); ++j)
+        if (r_string[j] < '0' || r_string[j] > '9')
+          valid = false;
+      for (size_t j = 0; j < s_string.size(); ++j)
+        if (s_string[j] < '0' || s_string[j] > '9')
+          valid = false;
+      if (!valid)
+        return false;
+      r = std::stoi(r_string);
+      s = std::stoi(s_string);
+      return true;
+    }
+  }
+  return false;
+}
+
 typedef std::function<bool(int, int)> demasking_function_t;
 /// Return the appropriate assignable function.
 demasking_function_t mask_function(std::string name, bool no_optimize = false) {
@@ -33,25 +71,30 @@ demasking_function_t mask_function(std::string name, bool no_optimize = false) {
   if (name == "all")
     return nullptr;
 
-  for (size_t i = 1; i + 1 < name.size(); ++i) {
-    if (name[i] == '-') {
-      std::string r_string = name.substr(0, i),
-                  s_string = name.substr(i + 1, name.size() - i - 1);
-      bool valid = true;
-      for (size_t j = 0; j < r_string.size(); ++j)
-        if (r_string[j] < '0' || r_string[j] > '9')
-          valid = false;
-      for (size_t j = 0; j < s_string.size(); ++j)
-        if (s_string[j] < '0' || s_string[j] > '9')
-          valid = false;
-      if (!valid)
-        break;
-      size_t r = std::stoi(r_string), s = std::stoi(s_string);
+  size_t r, s;
+  if (parse_r_to_s(name, r, s)) {
       return [r, s](size_t ones, size_t total) {
         return f_r_to_s(ones, total, r, s);
       };
-    }
   }
 
   throw std::invalid_argument("unknown function name");
 }
+
+/// Call the callback with the functor of the given demasking function.
+/// This allows the dispatch on the name to happen only once and the function to be inlined in the callback.
+template <typename callback_t>
+void with_demasking_functor(std::string name, callback_t callback) {
+  size_t r, s;
+  if (name == "or") {
+    callback(or_functor());
+  } else if (name == "and") {
+    callback(and_functor());
+  } else if (name == "xor") {
+    callback(xor_functor());
+  } else if (parse_r_to_s(name, r, s)) {
+    callback(r_to_s_functor{r, s});
+  } else {
+    throw std::invalid_argument("unknown function name");
+  }
+}
@@ -1,5 +1,16 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FMSI_X86_SIMD
+#endif
+
 static const uint8_t nucleotideToInt[] = {
         4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
         4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
@@ -49,12 +60,148 @@ void ReverseComplementStringInPlace(char* s, size_t length) {
     }
 }
 
-/// Reverse complement a string and return it.
-char* ReverseComplementString(const char* s, size_t length) {
-    char* result = new char[length];
+/// Instruction sets for which the per-character routines below are vectorized.
+enum class SimdLevel {
+    scalar,
+    sse4,
+    avx2,
+};
+
+/// Return the best instruction set supported by the running CPU.
+inline SimdLevel DetectSimdLevel() {
+#ifdef FMSI_X86_SIMD
+    static const SimdLevel level = __builtin_cpu_supports("avx2") ? SimdLevel::avx2
+            : __builtin_cpu_supports("sse4.1") ? SimdLevel::sse4 : SimdLevel::scalar;
+    return level;
+#else
+    return SimdLevel::scalar;
+#endif
+}
+
+/// Write the reverse complement of the last [length] characters of s to the first [length] characters of result.
+inline void ReverseComplementScalar(const char* s, char* result, size_t length) {
     for (size_t i = 0; i < length; ++i) {
         result[i] = complementaryNucleotide[(uint8_t)s[length - i - 1]];
     }
+}
+
+/// Return the index of the first character which is not a nucleotide or length if there is none.
+inline size_t NextInvalidNucleotideScalar(const char* s, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        if (nucleotideToInt[(uint8_t)s[i]] == 4) {
+            return i;
+        }
+    }
+    return length;
+}
+
+#ifdef FMSI_X86_SIMD
+// The vectorized versions recognize nucleotides case-insensitively as (c | 0x20) in {a, c, g, t}
+// and complement them by looking up their low nibble, which is the same for both cases.
+
+__attribute__((target("sse4.1")))
+inline __m128i ValidNucleotidesSSE4(__m128i v) {
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i valid = _mm_cmpeq_epi8(lower, _mm_set1_epi8('a'));
+    valid = _mm_or_si128(valid, _mm_cmpeq_epi8(lower, _mm_set1_epi8('c')));
+    valid = _mm_or_si128(valid, _mm_cmpeq_epi8(lower, _mm_set1_epi8('g')));
+    return _mm_or_si128(valid, _mm_cmpeq_epi8(lower, _mm_set1_epi8('t')));
+}
+
+__attribute__((target("sse4.1")))
+inline void ReverseComplementSSE4(const char* s, char* result, size_t length) {
+    const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i complement = _mm_setr_epi8('N', 'T', 'N', 'G', 'A', 'N', 'N', 'C', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N');
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(s + length - i - 16)), reverse);
+        __m128i c = _mm_shuffle_epi8(complement, _mm_and_si128(v, _mm_set1_epi8(0x0F)));
+        c = _mm_or_si128(c, _mm_and_si128(v, _mm_set1_epi8(0x20)));
+        c = _mm_blendv_epi8(_mm_set1_epi8('N'), c, ValidNucleotidesSSE4(v));
+        _mm_storeu_si128((__m128i*)(result + i), c);
+    }
+    ReverseComplementScalar(s, result + i, length - i);
+}
+
+__attribute__((target("sse4.1")))
+inline size_t NextInvalidNucleotideSSE4(const char* s, size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        uint32_t invalid = ~(uint32_t)_mm_movemask_epi8(ValidNucleotidesSSE4(v)) & 0xFFFF;
+        if (invalid) return i + __builtin_ctz(invalid);
+    }
+    return i + NextInvalidNucleotideScalar(s + i, length - i);
+}
+
+__attribute__((target("avx2")))
+inline __m256i ValidNucleotidesAVX2(__m256i v) {
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i valid = _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('a'));
+    valid = _mm256_or_si256(valid, _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('c')));
+    valid = _mm256_or_si256(valid, _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('g')));
+    return _mm256_or_si256(valid, _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('t')));
+}
+
+__attribute__((target("avx2")))
+inline void ReverseComplementAVX2(const char* s, char* result, size_t length) {
+    const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                             15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256i complement = _mm256_setr_epi8('N', 'T', 'N', 'G', 'A', 'N', 'N', 'C', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N',
+                                                'N', 'T', 'N', 'G', 'A', 'N', 'N', 'C', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N');
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(s + length - i - 32)), reverse);
+        // The shuffle reverses each 128-bit lane separately; swap the lanes to reverse the whole vector.
+        v = _mm256_permute2x128_si256(v, v, 1);
+        __m256i c = _mm256_shuffle_epi8(complement, _mm256_and_si256(v, _mm256_set1_epi8(0x0F)));
+        c = _mm256_or_si256(c, _mm256_and_si256(v, _mm256_set1_epi8(0x20)));
+        c = _mm256_blendv_epi8(_mm256_set1_epi8('N'), c, ValidNucleotidesAVX2(v));
+        _mm256_storeu_si256((__m256i*)(result + i), c);
+    }
+    ReverseComplementSSE4(s, result + i, length - i);
+}
+
+__attribute__((target("avx2")))
+inline size_t NextInvalidNucleotideAVX2(const char* s, size_t length) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+        uint32_t invalid = ~(uint32_t)_mm256_movemask_epi8(ValidNucleotidesAVX2(v));
+        if (invalid) return i + __builtin_ctz(invalid);
+    }
+    return i + NextInvalidNucleotideSSE4(s + i, length - i);
+}
+#endif
+
+/// Write the reverse complement of s to result, using the best available instruction set.
+inline void ReverseComplement(const char* s, char* result, size_t length) {
+#ifdef FMSI_X86_SIMD
+    switch (DetectSimdLevel()) {
+        case SimdLevel::avx2: return ReverseComplementAVX2(s, result, length);
+        case SimdLevel::sse4: return ReverseComplementSSE4(s, result, length);
+        default: break;
+    }
+#endif
+    ReverseComplementScalar(s, result, length);
+}
+
+/// Return the index of the first character which is not a nucleotide or length if there is none.
+inline size_t NextInvalidNucleotide(const char* s, size_t length) {
+#ifdef FMSI_X86_SIMD
+    switch (DetectSimdLevel()) {
+        case SimdLevel::avx2: return NextInvalidNucleotideAVX2(s, length);
+        case SimdLevel::sse4: return NextInvalidNucleotideSSE4(s, length);
+        default: break;
+    }
+#endif
+    return NextInvalidNucleotideScalar(s, length);
+}
+
+/// Reverse complement a string and return it.
+char* ReverseComplementString(const char* s, size_t length) {
+    char* result = new char[length];
+    ReverseComplement(s, result, length);
     return result;
 }
 
@@ -67,6 +214,80 @@ bool AreStringsEqual(const char* a, const char* b, size_t length) {
     return true;
 }
 
+/// Hash of an encoded k-mer, so that the sampled minimizers do not depend on the lexicographic order.
+template <typename kmer_t>
+inline uint64_t KMerHash(kmer_t kmer) {
+    uint64_t x = uint64_t(kmer);
+    if constexpr (sizeof(kmer_t) > sizeof(uint64_t)) {
+        x ^= uint64_t(kmer >> 64) * 0x9E3779B97F4A7C15ull;
+    }
+    // The finalizer of SplitMix64.
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+/// Fill in [positions] with the increasing positions of the canonical (w,k)-minimizers of the sequence,
+/// i.e., of the k-mers whose canonical form has the smallest hash among w consecutive k-mers without invalid characters.
+/// Runs of valid characters shorter than a window contribute their single minimizer.
+template <typename kmer_t>
+void CanonicalMinimizerPositions(const char* sequence, size_t length, int k, int w, std::vector<size_t>& positions) {
+    positions.clear();
+    kmer_t mask = kmer_t(1) << (2 * k - 1);
+    mask |= mask - 1;
+    kmer_t forward = 0, reverse = 0;
+    size_t valid = 0;
+    // The candidates for minimizers of the current window with increasing hashes.
+    std::deque<std::pair<uint64_t, size_t>> window;
+    auto end_run = [&]() {
+        if (valid >= (size_t)k && valid < (size_t)(k + w - 1)) {
+            positions.push_back(window.front().second);
+        }
+        valid = 0;
+        window.clear();
+    };
+    for (size_t i = 0; i < length; ++i) {
+        uint8_t c = nucleotideToInt[(uint8_t)sequence[i]];
+        if (c == 4) {
+            end_run();
+            continue;
+        }
+        forward = ((forward << 2) | kmer_t(c)) & mask;
+        reverse = (reverse >> 2) | (kmer_t(3 - c) << (2 * (k - 1)));
+        if (++valid < (size_t)k) continue;
+        size_t position = i + 1 - k;
+        uint64_t hash = KMerHash(std::min(forward, reverse));
+        while (!window.empty() && window.back().first > hash) {
+            window.pop_back();
+        }
+        window.emplace_back(hash, position);
+        if (window.front().second + w <= position) {
+            window.pop_front();
+        }
+        if (valid >= (size_t)(k + w - 1) && (positions.empty() || positions.back() != window.front().second)) {
+            positions.push_back(window.front().second);
+        }
+    }
+    end_run();
+}
+
+/// Fill in [positions] with every [step]-th position of the sequence at which a k-mer without invalid characters starts.
+void SampledPositions(const char* sequence, size_t length, int k, int step, std::vector<size_t>& positions) {
+    positions.clear();
+    size_t position = 0;
+    while (position + k <= length) {
+        size_t invalid = NextInvalidNucleotide(sequence + position, k);
+        if (invalid == (size_t)k) {
+            positions.push_back(position);
+            position += step;
+        } else {
+            // Continue with the first sampled position after the invalid character.
+            size_t next = position + invalid + 1;
+            position += (next - position + step - 1) / step * step;
+        }
+    }
+}
+
 
 inline bool is_upper(char c) {
     return c >= 'A' && c <= 'Z';
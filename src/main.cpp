@@ -7,10 +7,12 @@
 #include "compact.h"
 
 #include <fstream>
+#include <memory>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <math.h>
 
 static int usage() {
@@ -23,6 +25,7 @@ static int usage() {
   std::cerr << "    index   - Creates a BWT based index of the given masked superstring." << std::endl;
   std::cerr << "    query   - Queries k-mers against an index." << std::endl;
   std::cerr << "    lookup  - Return unique hashes of present k-mers." << std::endl;
+  std::cerr << "    filter  - Write the query records with (or without) matching k-mers." << std::endl;
   std::cerr << "    export  - Print the underlying masked superstring to stdout." << std::endl << std::endl;
   std::cerr << "Command (experimental, using f-MS framework):" << std::endl;
   std::cerr << "    union   - Compute union of k-mers from several indices." << std::endl;
@@ -78,6 +81,8 @@ static int usage_op(std::string op) {
               << std::endl;
     std::cerr << "  `-k value_of_k` - The size of queried k-mers (only used to check with the index one)."
               << std::endl;
+    std::cerr << "  `-d temporary_directory` - Count the k-mers of the result in files in the given directory instead of in memory."
+              << std::endl;
     std::cerr << std::endl;
     return 1;
 }
@@ -105,9 +110,22 @@ static int usage_query() {
   std::cerr << "Options (stable):" << std::endl;
   std::cerr << "  -q FILE - Path to FASTA/FASTQ with queries [default: stdin]"
             << std::endl;
+  std::cerr << "  -o FILE - Path to write the results to, compressed if it ends with .gz [default: stdout]" << std::endl;
+  std::cerr << "  -z      - Compress the output with gzip" << std::endl;
   std::cerr << "  -k INT  - Size of k-mers [default: infer automatically from index]"
             << std::endl;
   std::cerr << "  -S      - Use kLCP array for streamed queries (increses memory consumption)" << std::endl;
+  std::cerr << "  -C INT  - Cache SA ranges of k-mer suffixes in a table of 2^INT entries (e.g. 16), useful for redundant queries" << std::endl;
+  std::cerr << "  --summary      - Print the numbers of found, queried and all k-mers and the longest run of found k-mers of each record" << std::endl;
+  std::cerr << "  --min-frac NUM - Print with the summary whether at least NUM of the k-mers are found, query only until it is decided" << std::endl;
+  std::cerr << "  --max-frac NUM - Print with the summary whether at most NUM of the k-mers are found, query only until it is decided" << std::endl;
+  std::cerr << "  --kmer-list    - Read one k-mer with an optional identifier after whitespace per line and print one result per line" << std::endl;
+  std::cerr << "  --packed       - With --kmer-list, write the results as bits packed into bytes, the first in the lowest bit" << std::endl;
+  std::cerr << "  --encoded      - Read k-mers as little-endian 64-bit (k <= 32) or 128-bit (k <= 64) integers with 2 bits per nucleotide," << std::endl;
+  std::cerr << "                   A=0, C=1, G=2, T=3, the first nucleotide the most significant, and write the results packed into bits" << std::endl;
+  std::cerr << "  -s INT  - Query only every INT-th k-mer and print the estimated containment of each record" << std::endl;
+  std::cerr << "  -w INT  - Query only canonical minimizers of windows of INT k-mers and print the estimated containment" << std::endl;
+  std::cerr << "            The output columns are: name, estimate, lower and upper bound of 95% confidence interval, found, sampled." << std::endl;
   std::cerr << "  -O      - FMSI uses properties of max-one masked superstrings to speed up queries" << std::endl;
   std::cerr << "            Use only if a masked superstring with maximum number of ones is indexed." << std::endl;
   std::cerr << "Parameters (experimental, using f-MS framework):" << std::endl;
@@ -122,9 +140,41 @@ static int usage_lookup() {
   std::cerr << "Options (stable):" << std::endl;
   std::cerr << "  -q FILE - Path to FASTA/FASTQ with queries [default: stdin]"
             << std::endl;
+  std::cerr << "  -o FILE - Path to write the results to, compressed if it ends with .gz [default: stdout]" << std::endl;
+  std::cerr << "  -z      - Compress the output with gzip" << std::endl;
   std::cerr << "  -k INT  - Size of k-mers [default: infer automatically from index]"
             << std::endl;
   std::cerr << "  -S      - Use kLCP array for streamed queries (increses memory consumption)" << std::endl;
+  std::cerr << "  -C INT  - Cache SA ranges of k-mer suffixes in a table of 2^INT entries (e.g. 16), useful for redundant queries" << std::endl;
+  std::cerr << "  --summary      - Print the numbers of found, queried and all k-mers and the longest run of found k-mers of each record" << std::endl;
+  std::cerr << "  --min-frac NUM - Print with the summary whether at least NUM of the k-mers are found, query only until it is decided" << std::endl;
+  std::cerr << "  --max-frac NUM - Print with the summary whether at most NUM of the k-mers are found, query only until it is decided" << std::endl;
+  std::cerr << "  --kmer-list    - Read one k-mer with an optional identifier after whitespace per line and print one result per line" << std::endl;
+  std::cerr << "  --encoded      - Read k-mers as little-endian 64-bit (k <= 32) or 128-bit (k <= 64) integers with 2 bits per nucleotide," << std::endl;
+  std::cerr << "                   A=0, C=1, G=2, T=3, the first nucleotide the most significant, and write the orders as little-endian int64" << std::endl;
+  std::cerr << "  --binary PREFIX - Write the orders as little-endian int32 (int64 for indexes over 2^31 characters) to PREFIX.orders," << std::endl;
+  std::cerr << "                   the order width, the number of records and their offsets as uint64 to PREFIX.index" << std::endl;
+  std::cerr << "                   and the names of the records to PREFIX.names" << std::endl;
+  std::cerr << std::endl;
+  return 1;
+}
+
+static int usage_filter() {
+  std::cerr << std::endl;
+  std::cerr << "Usage:   fmsi filter [options] <index-prefix>" << std::endl << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  -q FILE         - Path to FASTA/FASTQ with records to filter [default: stdin]" << std::endl;
+  std::cerr << "  -o FILE         - Path to write the passing records to, compressed if it ends with .gz [default: stdout]" << std::endl;
+  std::cerr << "                    The sequences and quality strings of the records are written on single lines" << std::endl;
+  std::cerr << "  -z              - Compress the output with gzip" << std::endl;
+  std::cerr << "  --keep-matching - Write the records with at least the minimum number of found k-mers [default]" << std::endl;
+  std::cerr << "  --drop-matching - Write the records with fewer than the minimum number of found k-mers" << std::endl;
+  std::cerr << "  --min-hits INT  - The minimum number of found k-mers of a matching record [default: 1]" << std::endl;
+  std::cerr << "  -k INT          - Size of k-mers [default: infer automatically from index]" << std::endl;
+  std::cerr << "  -S              - Use kLCP array for streamed queries (increses memory consumption)" << std::endl;
+  std::cerr << "  -O              - FMSI uses properties of max-one masked superstrings to speed up queries" << std::endl;
+  std::cerr << "Parameters (experimental, using f-MS framework):" << std::endl;
+  usage_functions();
   std::cerr << std::endl;
   return 1;
 }
@@ -145,6 +195,8 @@ static int usage_normalize() {
   std::cerr << "    `-s` - Only print the compacted masked superstring and do not "
                "compact the index"
             << std::endl;
+  std::cerr << "    `-d temporary_directory` - Count the k-mers in files in the given directory instead of in memory."
+            << std::endl;
   usage_functions();
   std::cerr << std::endl;
   return 1;
@@ -235,6 +287,410 @@ int ms_index(int argc, char *argv[]) {
   return 0;
 }
 
+/// Which k-mers of the records are queried when only estimating the containment of the records.
+struct sampling_options {
+    /// Query every sample_step-th k-mer if positive.
+    int sample_step = 0;
+    /// Query the canonical minimizers of windows of minimizer_window k-mers if positive.
+    int minimizer_window = 0;
+
+    bool enabled() const {
+        return sample_step > 0 || minimizer_window > 0;
+    }
+};
+
+/// Whether a summary of the results of each record is printed instead of the results.
+struct summary_options {
+    bool enabled = false;
+    /// If enabled, the query of a record stops as soon as it is decided whether its fraction of found k-mers is within them.
+    containment_thresholds thresholds;
+};
+
+/// Writes the orders of lookup in binary for tools which map them to memory instead of parsing them:
+/// - [prefix].orders with the orders of the k-mers of all records, -1 for absent ones, as little-endian int32 if [wide] is false
+///   and int64 otherwise,
+/// - [prefix].index with the width of the orders in bytes, the number of records and the offset of the first order of each
+///   record and of the end in [prefix].orders in orders, all as little-endian uint64,
+/// - [prefix].names with the names of the records on separate lines.
+/// The orders and the names are written on background threads.
+struct binary_orders_writer {
+  binary_orders_writer(const std::string& prefix, bool wide)
+      : wide(wide), index_path(prefix + ".index"), orders(prefix + ".orders", false), names(prefix + ".names", false) {}
+
+  void begin_record(const std::string& name) {
+    names_buffer += name;
+    names_buffer += '\n';
+  }
+
+  void append(const int64_t* result, size_t count) {
+    size_t width = wide ? sizeof(int64_t) : sizeof(int32_t);
+    size_t size = orders_buffer.size();
+    orders_buffer.resize(size + count * width);
+    char* out = orders_buffer.data() + size;
+    for (size_t i = 0; i < count; ++i, out += width) {
+      if (wide) {
+        memcpy(out, &result[i], width);
+      } else {
+        int32_t order = (int32_t)result[i];
+        memcpy(out, &order, width);
+      }
+    }
+    orders_count += count;
+  }
+
+  void end_record() {
+    offsets.push_back(orders_count);
+  }
+
+  /// Queue the buffered orders and names to be written.
+  void flush() {
+    orders.write(std::move(orders_buffer));
+    names.write(std::move(names_buffer));
+    orders_buffer = std::string();
+    names_buffer = std::string();
+  }
+
+  /// Write the rest and the index.
+  void close() {
+    flush();
+    orders.close();
+    names.close();
+    FILE* index_file = fopen(index_path.c_str(), "wb");
+    if (index_file == nullptr) {
+      throw std::invalid_argument("couldn't open file " + index_path + " for writing");
+    }
+    uint64_t header[2] = {wide ? sizeof(int64_t) : sizeof(int32_t), offsets.size() - 1};
+    fwrite(header, sizeof(uint64_t), 2, index_file);
+    fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), index_file);
+    fclose(index_file);
+  }
+
+private:
+  bool wide;
+  std::string index_path;
+  background_writer orders, names;
+  std::string orders_buffer, names_buffer;
+  uint64_t orders_count = 0;
+  std::vector<uint64_t> offsets = {0};
+};
+
+/// Append to [out] a line with the summary of each record in [batch]; with thresholds, the last column tells whether they are satisfied.
+void append_summaries(std::string& out, const query_batch& batch, bool output_orders, const summary_options& summary) {
+  for (size_t record = 0; record < batch.size(); ++record) {
+    size_t results_begin = record ? batch.result_ends[record - 1] : 0;
+    auto s = summarize_results(batch.results.data() + results_begin, batch.result_ends[record] - results_begin, batch.result_counts[record], output_orders);
+    out += batch.names[record];
+    for (size_t value : {s.found, s.queried, s.total, s.longest_run}) {
+      out += '\t';
+      out += std::to_string(value);
+    }
+    if (summary.thresholds.enabled()) {
+      out += summary.thresholds.satisfied(s.found, s.queried, s.total) ? "\t1" : "\t0";
+    }
+    out += '\n';
+  }
+}
+
+/// Query a sample of k-mers of each record in [batch] and append to [out] a line with the estimated containment of each record.
+template <query_mode mode, typename demasking_function>
+void screen_batch(fms_index& index, const query_batch& batch, int k, const sampling_options& sampling, query_batch& sample,
+                  query_scratch& scratch, std::vector<size_t>& positions, std::string& out, demasking_function f) {
+  // The sampled k-mers form a batch of single k-mer records, which is searched in bulk.
+  sample.clear();
+  std::vector<size_t> sample_ends(batch.size());
+  for (size_t record = 0; record < batch.size(); ++record) {
+    const char* sequence = batch.sequence(record);
+    size_t length = batch.sequence_size(record);
+    if (sampling.minimizer_window > 0) {
+      if (k <= 32) CanonicalMinimizerPositions<uint64_t>(sequence, length, k, sampling.minimizer_window, positions);
+      else CanonicalMinimizerPositions<__uint128_t>(sequence, length, k, sampling.minimizer_window, positions);
+    } else {
+      SampledPositions(sequence, length, k, sampling.sample_step, positions);
+    }
+    for (size_t position : positions) {
+      sample.add_borrowed_record("", sequence + position, k);
+    }
+    sample_ends[record] = sample.size();
+  }
+  query_batch_records<mode, demasking_function>(index, sample, k, false, false, scratch, containment_thresholds(), f);
+
+  char buffer[32];
+  for (size_t record = 0; record < batch.size(); ++record) {
+    containment_estimate estimate;
+    for (size_t kmer = record ? sample_ends[record - 1] : 0; kmer < sample_ends[record]; ++kmer) {
+      ++estimate.sampled;
+      estimate.found += sample.results[kmer] == 1;
+    }
+    auto [lower, upper] = estimate.confidence_interval();
+    snprintf(buffer, sizeof(buffer), "\t%.4f\t%.4f\t%.4f\t", estimate.estimate(), lower, upper);
+    out += batch.names[record];
+    out += buffer;
+    out += std::to_string(estimate.found);
+    out += '\t';
+    out += std::to_string(estimate.sampled);
+    out += '\n';
+  }
+}
+
+/// A batch of query records read ahead of the queries.
+struct input_batch {
+  query_batch batch;
+  /// Whether each record of the batch is the first and the last window of a query record.
+  std::vector<bool> first_windows, last_windows;
+};
+
+/// Query all records of the mapped file if it is open and read by [seq] otherwise in batches and write the results to [writer].
+/// The batches are read on a background thread, so that the decompression and parsing overlap with the queries.
+/// If [range_cache_size_log] is positive, SA ranges of k-mer suffixes are cached in a table with 2^range_cache_size_log entries.
+/// If [sampling] is enabled, only a sample of k-mers is queried and the estimated containment of each record is printed instead.
+/// If [summary] is enabled, the summary of the results of each record is printed instead of the results.
+/// Otherwise, long records are read and queried in overlapping windows, so that the memory does not depend on their length.
+template <query_mode mode, typename demasking_function = demasking_function_t>
+void query_records(fms_index& index, const mapped_file& mapping, kseq_t *seq, int k, bool has_klcp, bool output_orders, int range_cache_size_log,
+                   const sampling_options& sampling, const summary_options& summary, background_writer& writer,
+                   binary_orders_writer* binary_output, demasking_function f = demasking_function()) {
+  // Batches of about 1 MB of sequence amortize the per-call overhead of short reads while keeping the memory small.
+  // Lists of k-mers are searched in bulk, which deduplicates and shares more work in larger batches.
+  constexpr size_t max_batch_sequence_length = 1 << 20, max_kmer_batch_sequence_length = 1 << 24;
+  constexpr size_t max_window_length = 1 << 20;
+  size_t batch_sequence_length = max_batch_sequence_length;
+  // The summaries and the estimates are computed over whole records.
+  bool whole_records = sampling.enabled() || summary.enabled;
+  size_t window_length = whole_records ? SIZE_MAX : max_window_length;
+  windowed_reader reader = mapping.is_open() ? windowed_reader(mapping, window_length, k - 1)
+                                             : windowed_reader(seq, window_length, k - 1);
+  auto read_batch = [&](input_batch& input) {
+    auto& batch = input.batch;
+    while (batch.sequence_length < batch_sequence_length && reader.read() >= 0) {
+      // Windows in the mapping outlive the batch; the others are overwritten by the next read.
+      std::string_view name = reader.first ? reader.name() : std::string_view();
+      if (reader.in_mapping()) {
+        batch.add_borrowed_record(name, reader.window, reader.window_size);
+      } else {
+        batch.add_record(name, reader.window, reader.window_size);
+      }
+      input.first_windows.push_back(reader.first);
+      input.last_windows.push_back(reader.last);
+    }
+    bool kmer_list = true;
+    for (size_t record = 0; record < batch.size() && kmer_list; ++record) {
+      kmer_list = is_kmer_record(batch, record, k);
+    }
+    batch_sequence_length = kmer_list ? max_kmer_batch_sequence_length : max_batch_sequence_length;
+    return batch.size() > 0;
+  };
+
+  query_scratch scratch;
+  if (range_cache_size_log > 0) {
+    scratch.range_cache = suffix_range_cache(range_cache_size_log, 16);
+    index.range_cache = &scratch.range_cache;
+  }
+  std::string out;
+  query_batch sample;
+  std::vector<size_t> positions;
+  auto process_batch = [&](input_batch& input) {
+    auto& batch = input.batch;
+    out.clear();
+    if (sampling.enabled()) {
+      screen_batch<mode, demasking_function>(index, batch, k, sampling, sample, scratch, positions, out, f);
+      writer.write(std::move(out));
+      return;
+    }
+
+    query_batch_records<mode, demasking_function>(index, batch, k, has_klcp, output_orders, scratch, summary.thresholds, f);
+
+    if (summary.enabled) {
+      append_summaries(out, batch, output_orders, summary);
+      writer.write(std::move(out));
+      return;
+    }
+    for (size_t record = 0; record < batch.size(); ++record) {
+      size_t results_begin = record ? batch.result_ends[record - 1] : 0;
+      size_t results_count = batch.result_ends[record] - results_begin;
+      if (!input.last_windows[record]) {
+        // The other k-mers overlapping the end of the window are queried in the next window.
+        size_t window_length = batch.sequence_size(record);
+        results_count = std::min(results_count, window_length - k + 1);
+      }
+      if (binary_output) {
+        if (input.first_windows[record]) binary_output->begin_record(batch.names[record]);
+        binary_output->append(batch.results.data() + results_begin, results_count);
+        if (input.last_windows[record]) binary_output->end_record();
+        continue;
+      }
+      if (input.first_windows[record]) {
+        out += batch.names[record];
+        out += '\t';
+      }
+      // The previous windows of the record are full, so they have some results.
+      if (output_orders && !input.first_windows[record] && results_count) {
+        out += ',';
+      }
+      append_query_results(out, batch.results.data() + results_begin, results_count, output_orders);
+      if (input.last_windows[record]) {
+        out += '\n';
+      }
+    }
+    if (binary_output) {
+      binary_output->flush();
+      return;
+    }
+    writer.write(std::move(out));
+  };
+  process_batches_in_pipeline<input_batch>(read_batch, process_batch);
+
+  if (index.range_cache) {
+    auto& cache = *index.range_cache;
+    std::cerr << "Suffix range cache: " << cache.hits << " hits in " << cache.lookups << " lookups ("
+              << 100 * cache.hit_rate() << "%)" << std::endl;
+    index.range_cache = nullptr;
+  }
+}
+
+/// Packs bits into bytes, the first in the least significant bit of the first byte.
+struct bit_packer {
+  uint8_t bits = 0;
+  int count = 0;
+
+  void append(std::string& out, bool bit) {
+    bits |= uint8_t(bit) << count;
+    if (++count == 8) flush(out);
+  }
+
+  /// Append the incomplete byte, if any.
+  void flush(std::string& out) {
+    if (count == 0) return;
+    out.push_back((char)bits);
+    bits = count = 0;
+  }
+};
+
+/// A block of lines of a k-mer list; the k-mer of each line is a record of the batch and its identifier is the name.
+struct kmer_list_batch {
+  query_batch batch;
+  /// Whether the k-mer of each line has length k and only nucleotides; the others are not searched and not found.
+  std::vector<bool> valid;
+};
+
+/// Query the k-mers of a list read by [reader] in batches and write one result per line to [writer], after the identifier
+/// of the line if it has one, or if [packed], write the bits of the results of all lines packed into bytes,
+/// with the first line in the least significant bit of the first byte.
+template <query_mode mode, typename demasking_function = demasking_function_t>
+void query_kmer_list(fms_index& index, kmer_list_reader& reader, int k, bool has_klcp, bool output_orders, bool packed,
+                     background_writer& writer, demasking_function f = demasking_function()) {
+  // The k-mers are searched in bulk, which deduplicates and shares more work in larger batches.
+  constexpr size_t max_batch_sequence_length = 1 << 24;
+  // Invalid k-mers are replaced by a valid one to keep the batch searchable in bulk.
+  const std::string placeholder(k, 'A');
+  auto read_batch = [&](kmer_list_batch& input) {
+    std::string_view kmer, id;
+    while (input.batch.sequence_length < max_batch_sequence_length && reader.read(kmer, id)) {
+      bool valid = kmer.size() == (size_t)k && NextInvalidNucleotide(kmer.data(), k) == (size_t)k;
+      input.batch.add_record(id, valid ? kmer.data() : placeholder.data(), k);
+      input.valid.push_back(valid);
+    }
+    return input.batch.size() > 0;
+  };
+
+  query_scratch scratch;
+  std::string out;
+  bit_packer packer;
+  auto process_batch = [&](kmer_list_batch& input) {
+    auto& batch = input.batch;
+    out.clear();
+    query_batch_records<mode, demasking_function>(index, batch, k, has_klcp, output_orders, scratch, containment_thresholds(), f);
+    for (size_t record = 0; record < batch.size(); ++record) {
+      int64_t result = input.valid[record] ? batch.results[batch.result_ends[record] - 1] : -1;
+      if (packed) {
+        packer.append(out, result == 1);
+        continue;
+      }
+      if (!batch.names[record].empty()) {
+        out += batch.names[record];
+        out += '\t';
+      }
+      append_query_results(out, &result, 1, output_orders);
+      out += '\n';
+    }
+    writer.write(std::move(out));
+  };
+  process_batches_in_pipeline<kmer_list_batch>(read_batch, process_batch);
+  out.clear();
+  packer.flush(out);
+  writer.write(std::move(out));
+}
+
+/// Query the k-mers encoded as in reencode_kmer_by_suffix, read from [fp] as little-endian integers of type kmer_t,
+/// and write their results to [writer] in binary: the bits packed by bit_packer, or the orders as little-endian int64.
+template <query_mode mode, typename demasking_function, typename kmer_t>
+void query_encoded_kmer_file(fms_index& index, gzFile fp, int k, bool output_orders, background_writer& writer,
+                             demasking_function f = demasking_function()) {
+  constexpr size_t max_batch_size = 1 << 20;
+  size_t trailing_bytes = 0;
+  auto read_batch = [&](std::vector<kmer_t>& batch) {
+    batch.resize(max_batch_size);
+    int bytes = gzread(fp, batch.data(), max_batch_size * sizeof(kmer_t));
+    if (bytes < 0) bytes = 0;
+    batch.resize(bytes / sizeof(kmer_t));
+    trailing_bytes += bytes % sizeof(kmer_t);
+    return !batch.empty();
+  };
+
+  std::vector<int64_t> results;
+  std::string out;
+  bit_packer packer;
+  auto process_batch = [&](std::vector<kmer_t>& batch) {
+    results.resize(batch.size());
+    query_encoded_kmers<mode>(index, batch.data(), batch.size(), k, output_orders, results.data(), f);
+    if (output_orders) {
+      writer.write(std::string((const char *)results.data(), results.size() * sizeof(int64_t)));
+      return;
+    }
+    out.clear();
+    for (int64_t result : results) {
+      packer.append(out, result == 1);
+    }
+    writer.write(std::move(out));
+  };
+  process_batches_in_pipeline<std::vector<kmer_t>>(read_batch, process_batch);
+  out.clear();
+  packer.flush(out);
+  writer.write(std::move(out));
+  if (trailing_bytes) {
+    std::cerr << "WARNING: Ignoring " << trailing_bytes << " bytes at the end of the input which do not form a whole k-mer." << std::endl;
+  }
+}
+
+/// Close the writer and return the exit code of the command, reporting the error if the output could not be written.
+static int close_writer(background_writer &writer) {
+  if (writer.close()) return 0;
+  std::cerr << "ERROR: The output could not be written: " << writer.error() << std::endl;
+  return 1;
+}
+
+/// Check the loaded index against the query parameters; if [k] is 0, set it to the k of the index.
+/// Return false after printing the error if the index cannot be queried.
+static bool check_query_index(const fms_index &index, bool has_klcp, int &k) {
+  if (index.sa_transformed_mask.size() == 0) {
+    std::cerr << "ERROR: index not correctly loaded. Ensure that you correctly call `fmsi index` before." << std::endl;
+    return false;
+  }
+
+  if (has_klcp != (index.klcp.size() > 0)) {
+    std::cerr << "ERROR: kLCP array was not constructed for the given index. Either construct it again without the `-s` flag or use `query -s` which slows down streaming queries." << std::endl;
+    return false;
+  }
+  int index_k = index.k;
+  if (k != 0 && k != index_k) {
+    std::cerr << "ERROR: Mismatch. Provided k (" << k << ") does not match the k of the index (" << index_k << ")." << std::endl;
+    return false;
+  }
+  if (k == 0) {
+    k = index_k;
+  }
+  return true;
+}
+
 int ms_query(int argc, char *argv[], bool output_orders) {
   bool usage = false;
   int c;
@@ -247,11 +703,83 @@ int ms_query(int argc, char *argv[], bool output_orders) {
   }
 
   std::string query_fn = "-";
+  std::string output_fn = "-";
   std::string f_name = "or";
   std::function<bool(size_t, size_t)> f = mask_function("or");
-  bool has_klcp = false;
-  while ((c = getopt(argc, argv, "f:hq:k:OS")) >= 0) {
+  bool has_klcp = false, compress = false;
+  int range_cache_size_log = 0;
+  sampling_options sampling;
+  summary_options summary;
+  bool kmer_list = false, packed = false, encoded = false;
+  std::string binary_prefix;
+  enum { summary_option = 256, min_frac_option, max_frac_option, kmer_list_option, packed_option, encoded_option, binary_option };
+  static const option long_options[] = {
+      {"summary", no_argument, nullptr, summary_option},
+      {"min-frac", required_argument, nullptr, min_frac_option},
+      {"max-frac", required_argument, nullptr, max_frac_option},
+      {"kmer-list", no_argument, nullptr, kmer_list_option},
+      {"packed", no_argument, nullptr, packed_option},
+      {"encoded", no_argument, nullptr, encoded_option},
+      {"binary", required_argument, nullptr, binary_option},
+      {nullptr, 0, nullptr, 0},
+  };
+  while ((c = getopt_long(argc, argv, output_orders ? "f:hq:o:zk:OSC:" : "f:hq:o:zk:OSC:s:w:", long_options, nullptr)) >= 0) {
     switch (c) {
+    case kmer_list_option:
+      kmer_list = true;
+      break;
+    case binary_option:
+      if (!output_orders) {
+        std::cerr << "ERROR: Only the orders of lookup can be written in binary." << std::endl;
+        return usage_query();
+      }
+      binary_prefix = optarg;
+      break;
+    case encoded_option:
+      encoded = true;
+      break;
+    case packed_option:
+      if (output_orders) {
+        std::cerr << "ERROR: Only the results of query can be packed into bits." << std::endl;
+        return usage_lookup();
+      }
+      packed = true;
+      break;
+    case summary_option:
+      summary.enabled = true;
+      break;
+    case min_frac_option:
+    case max_frac_option: {
+      double fraction = atof(optarg);
+      if (fraction < 0 || fraction > 1) {
+        std::cerr << "ERROR: The thresholds on the fraction of found k-mers must be between 0 and 1." << std::endl;
+        return usage_query(output_orders);
+      }
+      (c == min_frac_option ? summary.thresholds.min_fraction : summary.thresholds.max_fraction) = fraction;
+      summary.enabled = true;
+      break;
+    }
+    case 's':
+      sampling.sample_step = atoi(optarg);
+      if (sampling.sample_step < 1) {
+        std::cerr << "ERROR: The sampling step must be positive." << std::endl;
+        return usage_query();
+      }
+      break;
+    case 'w':
+      sampling.minimizer_window = atoi(optarg);
+      if (sampling.minimizer_window < 1) {
+        std::cerr << "ERROR: The minimizer window must be positive." << std::endl;
+        return usage_query();
+      }
+      break;
+    case 'C':
+      range_cache_size_log = atoi(optarg);
+      if (range_cache_size_log < 1 || range_cache_size_log > 30) {
+        std::cerr << "ERROR: The size of the suffix range cache must be between 1 and 30." << std::endl;
+        return usage_query(output_orders);
+      }
+      break;
     case 'f':
       try {
         f_name = optarg;
@@ -267,6 +795,12 @@ int ms_query(int argc, char *argv[], bool output_orders) {
     case 'q':
       query_fn = optarg;
       break;
+    case 'o':
+      output_fn = optarg;
+      break;
+    case 'z':
+      compress = true;
+      break;
     case 'k':
       k = atoi(optarg);
       break;
@@ -299,79 +833,286 @@ int ms_query(int argc, char *argv[], bool output_orders) {
     return usage_query(output_orders);
   }
 
-  fms_index index = load_index(fn, has_klcp);
-
-  if (index.sa_transformed_mask.size() == 0) {
-    std::cerr << "ERROR: index not correctly loaded. Ensure that you correctly call `fmsi index` before." << std::endl;
+  if (sampling.sample_step > 0 && sampling.minimizer_window > 0) {
+    std::cerr << "ERROR: Parameters -s and -w cannot be combined." << std::endl;
+    return usage_query();
+  }
+  if (sampling.enabled() && summary.enabled) {
+    std::cerr << "ERROR: Sampling cannot be combined with the summary output." << std::endl;
+    return usage_query();
+  }
+  if (packed && !kmer_list) {
+    std::cerr << "ERROR: Only the results of a k-mer list (--kmer-list) can be packed into bits." << std::endl;
+    return usage_query();
+  }
+  if ((kmer_list || encoded) && (sampling.enabled() || summary.enabled || range_cache_size_log > 0)) {
+    std::cerr << "ERROR: The k-mers of a list are searched in bulk, which cannot be combined with sampling, the summary or the cache." << std::endl;
+    return usage_query(output_orders);
+  }
+  if (kmer_list && encoded) {
+    std::cerr << "ERROR: Parameters --kmer-list and --encoded cannot be combined." << std::endl;
     return usage_query(output_orders);
   }
+  if (!binary_prefix.empty() && (kmer_list || encoded || summary.enabled)) {
+    std::cerr << "ERROR: The binary output cannot be combined with --kmer-list, --encoded or the summary." << std::endl;
+    return usage_lookup();
+  }
+  compress |= output_fn.size() > 3 && output_fn.compare(output_fn.size() - 3, 3, ".gz") == 0;
 
-  if (has_klcp != (index.klcp.size() > 0)) {
-    std::cerr << "ERROR: kLCP array was not constructed for the given index. Either construct it again without the `-s` flag or use `query -s` which slows down streaming queries." << std::endl;
+  fms_index index = load_index(fn, has_klcp);
+  if (!check_query_index(index, has_klcp, k)) {
     return usage_query(output_orders);
   }
-  int index_k = index.k;
-  if (k != 0 && k != index_k) {
-    std::cerr << "ERROR: Mismatch. Provided k (" << k << ") does not match the k of the index (" << index_k << ")." << std::endl;
+  if (sampling.minimizer_window > 0 && k > 64) {
+    std::cerr << "ERROR: Sampling minimizers with -w is only supported for k <= 64." << std::endl;
+    return usage_query();
+  }
+  if (encoded && k > 64) {
+    std::cerr << "ERROR: Encoded k-mers are only supported for k <= 64." << std::endl;
     return usage_query(output_orders);
   }
-  if (k == 0) {
-    k = index_k;
+
+  // The output is compressed and written on a background thread, which overlaps with the queries.
+  background_writer writer(output_fn, compress);
+
+  if (encoded) {
+    gzFile fp = OpenFile(query_fn);
+    // The k-mers are searched in bulk, whose kernels do not depend on k.
+    auto query_file = [&](auto kmer_type) {
+      using kmer_t = decltype(kmer_type);
+      if (f_name == "or") {
+        query_encoded_kmer_file<query_mode::orr, demasking_function_t, kmer_t>(index, fp, k, output_orders, writer);
+      } else if (f_name == "all") {
+        query_encoded_kmer_file<query_mode::all, demasking_function_t, kmer_t>(index, fp, k, output_orders, writer);
+      } else {
+        with_demasking_functor(f_name, [&](auto f) {
+          query_encoded_kmer_file<query_mode::general, decltype(f), kmer_t>(index, fp, k, output_orders, writer, f);
+        });
+      }
+    };
+    if (k <= 32) {
+      query_file(uint64_t());
+    } else {
+      query_file(__uint128_t());
+    }
+    gzclose(fp);
+    return close_writer(writer);
   }
 
-  gzFile fp = OpenFile(query_fn);
-  kseq_t *seq = kseq_init(fp);
-  int64_t sequence_length = 0;
+  // Uncompressed files are parsed in place, other inputs are streamed through zlib.
+  mapped_file mapping;
+  kseq_t *seq = mapping.open(query_fn) ? nullptr : kseq_init(OpenFile(query_fn));
 
   std::cin.tie(&std::cout);
+  std::unique_ptr<binary_orders_writer> binary_output;
+  if (!binary_prefix.empty()) {
+    binary_output = std::make_unique<binary_orders_writer>(binary_prefix, index.sa_transformed_mask.size() > (size_t)INT32_MAX);
+  }
 
-  while ((sequence_length = kseq_read(seq)) >= 0) {
-    // Small overhead for the chunking (while gaining superior time from prediction).
-    int64_t max_sequence_chunk_length = 400;
-    max_sequence_chunk_length = k + std::max((int64_t)10, std::min(max_sequence_chunk_length, 2*(int64_t)std::sqrt(sequence_length)));
-
-    std::cout << seq->name.s << "\t";
-
-    auto sequence = seq->seq.s;
-    bool output_comma = false;
-    while (sequence_length > 0) {
-        int64_t current_length = next_invalid_character_or_end(sequence, sequence_length);
-        
-        while (current_length >= k) {
-            if (output_orders && output_comma) std::cout << ",";
-            output_comma = true;
-            int64_t chunk_length = std::min(current_length, max_sequence_chunk_length);
-            if (f_name == "or") {
-                query_kmers<query_mode::orr>(index, sequence, chunk_length, k, has_klcp, std::cout, output_orders);
-            } else if (f_name == "all") {
-                query_kmers<query_mode::all>(index, sequence, chunk_length, k, has_klcp, std::cout, output_orders);
-            } else {
-                query_kmers<query_mode::general>(index, sequence, chunk_length, k, has_klcp, std::cout, output_orders, f);
-            }
-            sequence += chunk_length - k + 1;
-            current_length -= chunk_length - k + 1;
-            sequence_length -= chunk_length - k + 1;
-        }
-        // Skip also the next character.
-        sequence_length -= current_length + 1;
-        sequence += current_length + 1;
-        // Print 0 on invalid k-mers.
-        if (sequence_length >= 0) {
-          for (int64_t i = 0; i < std::min((int64_t) k, current_length + 1); ++i) {
-            if (output_orders) {
-              if (output_comma) std::cout << ",";
-              output_comma = true;
-              std::cout << "-1";
-            }
-            else {
-              std::cout << "0";
-            }
-          }
-        }
+  // Dispatch on the function only once so that it is inlined in the query loop.
+  if (kmer_list) {
+    kmer_list_reader reader = mapping.is_open() ? kmer_list_reader(mapping) : kmer_list_reader(seq);
+    if (f_name == "or") {
+      query_kmer_list<query_mode::orr, demasking_function_t>(index, reader, k, has_klcp, output_orders, packed, writer);
+    } else if (f_name == "all") {
+      query_kmer_list<query_mode::all, demasking_function_t>(index, reader, k, has_klcp, output_orders, packed, writer);
+    } else {
+      with_demasking_functor(f_name, [&](auto f) {
+        query_kmer_list<query_mode::general, decltype(f)>(index, reader, k, has_klcp, output_orders, packed, writer, f);
+      });
     }
-    std::cout << "\n";
+    return close_writer(writer);
   }
-  return 0;
+
+  if (f_name == "or") {
+    query_records<query_mode::orr, demasking_function_t>(index, mapping, seq, k, has_klcp, output_orders, range_cache_size_log, sampling, summary, writer, binary_output.get());
+  } else if (f_name == "all") {
+    query_records<query_mode::all, demasking_function_t>(index, mapping, seq, k, has_klcp, output_orders, range_cache_size_log, sampling, summary, writer, binary_output.get());
+  } else {
+    with_demasking_functor(f_name, [&](auto f) {
+      query_records<query_mode::general, decltype(f)>(index, mapping, seq, k, has_klcp, output_orders, range_cache_size_log, sampling, summary, writer, binary_output.get(), f);
+    });
+  }
+  if (binary_output) {
+    binary_output->close();
+  }
+  return close_writer(writer);
+}
+
+/// Append the record read by [seq] to [out] in its FASTA or FASTQ format, with the sequence and the quality on single lines.
+static void append_record(std::string &out, const kseq_t *seq) {
+  bool fastq = seq->qual.l > 0;
+  out += fastq ? '@' : '>';
+  out.append(seq->name.s, seq->name.l);
+  if (seq->comment.l) {
+    out += ' ';
+    out.append(seq->comment.s, seq->comment.l);
+  }
+  out += '\n';
+  out.append(seq->seq.s, seq->seq.l);
+  out += '\n';
+  if (fastq) {
+    out += "+\n";
+    out.append(seq->qual.s, seq->qual.l);
+    out += '\n';
+  }
+}
+
+/// A batch of records to filter read ahead of the queries.
+struct filter_batch {
+  query_batch batch;
+  /// The records as written by append_record; the record i ends at record_ends[i].
+  std::string records;
+  std::vector<size_t> record_ends;
+};
+
+/// Query all records read by [seq] in batches and write those with at least [min_hits] found k-mers to [writer] if
+/// [keep_matching], and the others otherwise. The query of a record stops as soon as it is decided.
+/// The batches are read on a background thread, so that the decompression and parsing overlap with the queries.
+template <query_mode mode, typename demasking_function = demasking_function_t>
+void filter_records(fms_index& index, kseq_t *seq, int k, bool has_klcp, size_t min_hits, bool keep_matching,
+                    background_writer &writer, demasking_function f = demasking_function()) {
+  constexpr size_t max_batch_sequence_length = 1 << 20;
+  auto read_batch = [&](filter_batch& input) {
+    int64_t sequence_length = 0;
+    while (input.batch.sequence_length < max_batch_sequence_length && (sequence_length = kseq_read(seq)) >= 0) {
+      input.batch.add_record(seq->name.s, seq->seq.s, sequence_length);
+      append_record(input.records, seq);
+      input.record_ends.push_back(input.records.size());
+    }
+    return input.batch.size() > 0;
+  };
+
+  query_scratch scratch;
+  containment_thresholds thresholds;
+  thresholds.min_found = min_hits;
+  size_t total_records = 0, written_records = 0;
+  auto process_batch = [&](filter_batch& input) {
+    auto& batch = input.batch;
+    query_batch_records<mode, demasking_function>(index, batch, k, has_klcp, false, scratch, thresholds, f);
+
+    std::string out;
+    for (size_t record = 0; record < batch.size(); ++record) {
+      size_t results_begin = record ? batch.result_ends[record - 1] : 0;
+      auto summary = summarize_results(batch.results.data() + results_begin, batch.result_ends[record] - results_begin, batch.result_counts[record], false);
+      if (thresholds.satisfied(summary.found, summary.queried, summary.total) == keep_matching) {
+        size_t record_begin = record ? input.record_ends[record - 1] : 0;
+        out.append(input.records, record_begin, input.record_ends[record] - record_begin);
+        ++written_records;
+      }
+    }
+    total_records += batch.size();
+    writer.write(std::move(out));
+  };
+  process_batches_in_pipeline<filter_batch>(read_batch, process_batch);
+  std::cerr << "Written " << written_records << " of " << total_records << " records" << std::endl;
+}
+
+int ms_filter(int argc, char *argv[]) {
+  bool usage = false;
+  int c;
+  int k = 0;
+  std::string fn;
+
+  if (argc > 1 && std::string(argv[argc - 1]) != "-h") {
+    fn = argv[argc - 1];
+    argc--;
+  }
+
+  std::string query_fn = "-", output_fn = "-";
+  std::string f_name = "or";
+  bool has_klcp = false, keep_matching = true, compress = false;
+  int64_t min_hits = 1;
+  enum { keep_matching_option = 256, drop_matching_option, min_hits_option };
+  static const option long_options[] = {
+      {"keep-matching", no_argument, nullptr, keep_matching_option},
+      {"drop-matching", no_argument, nullptr, drop_matching_option},
+      {"min-hits", required_argument, nullptr, min_hits_option},
+      {nullptr, 0, nullptr, 0},
+  };
+  while ((c = getopt_long(argc, argv, "f:hq:o:k:OSz", long_options, nullptr)) >= 0) {
+    switch (c) {
+    case keep_matching_option:
+      keep_matching = true;
+      break;
+    case drop_matching_option:
+      keep_matching = false;
+      break;
+    case min_hits_option:
+      min_hits = atoll(optarg);
+      if (min_hits < 1) {
+        std::cerr << "ERROR: The minimum number of hits must be positive." << std::endl;
+        return usage_filter();
+      }
+      break;
+    case 'f':
+      try {
+        mask_function(optarg);
+        f_name = optarg;
+      } catch (std::invalid_argument &) {
+        std::cerr << "ERROR: Function '" << optarg << "' not recognized." << std::endl;
+        return usage_filter();
+      }
+      break;
+    case 'h':
+      usage = true;
+      break;
+    case 'q':
+      query_fn = optarg;
+      break;
+    case 'o':
+      output_fn = optarg;
+      break;
+    case 'k':
+      k = atoi(optarg);
+      break;
+    case 'O':
+      if (f_name != "or") {
+        std::cerr << "WARNING: Parameter -O is ignored when parameter -f is specified." << std::endl;
+      } else {
+        f_name = "all";
+      }
+      break;
+    case 'S':
+      has_klcp = true;
+      break;
+    case 'z':
+      compress = true;
+      break;
+    default:
+      return usage_filter();
+    }
+  }
+  if (usage) {
+    usage_filter();
+    return 0;
+  } else if (fn.empty()) {
+    std::cerr << "ERROR: Path to the fasta file is a required argument." << std::endl;
+    return usage_filter();
+  }
+  compress |= output_fn.size() > 3 && output_fn.compare(output_fn.size() - 3, 3, ".gz") == 0;
+
+  fms_index index = load_index(fn, has_klcp);
+  if (!check_query_index(index, has_klcp, k)) {
+    return usage_filter();
+  }
+
+  gzFile fp = OpenFile(query_fn);
+  kseq_t *seq = kseq_init(fp);
+  background_writer writer(output_fn, compress);
+
+  if (f_name == "or") {
+    filter_records<query_mode::orr, demasking_function_t>(index, seq, k, has_klcp, min_hits, keep_matching, writer);
+  } else if (f_name == "all") {
+    filter_records<query_mode::all, demasking_function_t>(index, seq, k, has_klcp, min_hits, keep_matching, writer);
+  } else {
+    with_demasking_functor(f_name, [&](auto f) {
+      filter_records<query_mode::general, decltype(f)>(index, seq, k, has_klcp, min_hits, keep_matching, writer, f);
+    });
+  }
+  kseq_destroy(seq);
+  gzclose(fp);
+  return close_writer(writer);
 }
 
 int ms_merge(int argc, char *argv[]) {
@@ -441,14 +1182,14 @@ int ms_normalize(int argc, char *argv[]) {
   int c;
   int k = 0;
   bool only_print = false;
-  std::string fn;
+  std::string fn, temporary_directory;
   if (argc > 1 && std::string(argv[argc - 1]) != "-h") {
     fn = argv[argc - 1];
     argc--;
   }
 
   std::function<bool(size_t, size_t)> f = mask_function("or", true);
-  while ((c = getopt(argc, argv, "hk:f:s")) >= 0) {
+  while ((c = getopt(argc, argv, "hk:f:sd:")) >= 0) {
     switch (c) {
     case 'f':
       try {
@@ -470,6 +1211,9 @@ int ms_normalize(int argc, char *argv[]) {
     case 's':
       only_print = true;
       break;
+    case 'd':
+      temporary_directory = optarg;
+      break;
     default:
       return usage_normalize();
     }
@@ -491,7 +1235,7 @@ int ms_normalize(int argc, char *argv[]) {
     }
   std::cerr << "Loaded index" << std::endl;
   auto ms = export_ms(index);
-  ms = normalize(ms, index.k, f);
+  ms = normalize(ms, index.k, f, temporary_directory);
   std::cerr << "Compacted" << std::endl;
   if (only_print) {
     std::cout << ">exported f-masked superstring" << std::endl;
@@ -545,8 +1289,8 @@ int ms_op(int argc, char *argv[], std::string op) {
     int c;
     int k = 0;
     std::vector<std::string> fns;
-    std::string result_fn;
-    while ((c = getopt(argc, argv, "p:hr:k:")) >= 0) {
+    std::string result_fn, temporary_directory;
+    while ((c = getopt(argc, argv, "p:hr:k:d:")) >= 0) {
         switch (c) {
             case 'h':
                 usage = true;
@@ -560,6 +1304,9 @@ int ms_op(int argc, char *argv[], std::string op) {
             case 'k':
                 k = atoi(optarg);
                 break;
+            case 'd':
+                temporary_directory = optarg;
+                break;
             default:
                 return usage_merge();
         }
@@ -576,38 +1323,32 @@ int ms_op(int argc, char *argv[], std::string op) {
         std::cerr << "Path to the result file is a required argument." << std::endl;
         return usage_op(op);
     }
-    fms_index res = load_index(fns[0]);
-    std::cerr << "Loaded index " << fns[0] << std::endl;
-    if (k != 0 && k != res.k) {
-        std::cerr << "Provided k (." << k << ") does not match the k of the first index (" << res.k << ")." << std::endl;
-        return usage_op(op);
-    }
-
-
-    for (size_t i = 1; i < fns.size(); ++i) {
-        // TODO: investigate why this is needed (the ranks must have gotten set to nullptr somewhere).
-        res.ac_gt_rank = sdsl::rank_support_v5<1>(&res.ac_gt);
-        res.ac_rank = sdsl::rank_support_v5<1>(&res.ac);
-        res.gt_rank = sdsl::rank_support_v5<1>(&res.gt);
-        res = merge(res, load_index(fns[i]));
-        if (op == "diff") {
-            // TODO: investigate why this is needed (the ranks must have gotten set to nullptr somewhere).
-            res.ac_gt_rank = sdsl::rank_support_v5<1>(&res.ac_gt);
-            res.ac_rank = sdsl::rank_support_v5<1>(&res.ac);
-            res.gt_rank = sdsl::rank_support_v5<1>(&res.gt);
-            res = merge(res, load_index(fns[i]));
+    // Each index is exported only once and the masked superstrings are concatenated, so that only the result is indexed.
+    // The k-mers are counted once per input, so that an input with several ones of a k-mer counts it once.
+    std::string ms;
+    k_mer_inputs inputs;
+    int index_k = 0;
+    bool has_klcp = false;
+    for (size_t i = 0; i < fns.size(); ++i) {
+        fms_index index = load_index(fns[i]);
+        if (i == 0) {
+            index_k = index.k;
+            has_klcp = index.klcp.size() > 0;
+            if (k != 0 && k != index_k) {
+                std::cerr << "Provided k (" << k << ") does not match the k of the first index (" << index_k << ")." << std::endl;
+                return usage_op(op);
+            }
+        } else if (index.k != index_k) {
+            std::cerr << "The k of index " << fns[i] << " (" << index.k << ") does not match the k of the first index (" << index_k << ")." << std::endl;
+            return usage_op(op);
         }
-        std::cerr << "Loaded and merged index " << fns[i] << std::endl;
+        ms += export_ms(index);
+        inputs.ends.push_back(ms.size());
+        // The k-mers of the subtrahends have at least two ones, so that only those of the first set have exactly one.
+        inputs.weights.push_back(op == "diff" && i > 0 ? 2 : 1);
+        std::cerr << "Loaded index " << fns[i] << std::endl;
     }
 
-
-    // TODO: investigate why this is needed (the ranks must have gotten set to nullptr somewhere).
-    res.ac_gt_rank = sdsl::rank_support_v5<1>(&res.ac_gt);
-    res.ac_rank = sdsl::rank_support_v5<1>(&res.ac);
-    res.gt_rank = sdsl::rank_support_v5<1>(&res.gt);
-
-    auto ms = export_ms(res);
-
     demasking_function_t function = nullptr;
     if (op == "union") function =  mask_function("or", true);
     else if (op == "symdiff") function = mask_function("xor", true);
@@ -615,11 +1356,10 @@ int ms_op(int argc, char *argv[], std::string op) {
     else if (op == "inter") function = mask_function(std::to_string(fns.size()) + "-" + std::to_string(fns.size()), true);
     assert(function != nullptr);
 
-    ms = normalize(ms, res.k, function);
+    ms = normalize(ms, index_k, function, temporary_directory, inputs);
     std::cerr << "Compacted result" << std::endl;
 
-    if (res.k <= 32) res = construct<uint64_t>(ms, res.k, res.klcp.size() > 0);
-    else res = construct<__uint128_t>(ms, res.k, res.klcp.size() > 0);
+    fms_index res = index_k <= 32 ? construct<uint64_t>(ms, index_k, has_klcp) : construct<__uint128_t>(ms, index_k, has_klcp);
 
     dump_index(res, result_fn);
     std::cerr << "Result written" << std::endl;
@@ -661,6 +1401,9 @@ int ms_clean(int argc, char *argv[]) {
   if (std::filesystem::exists(fn + ".fmsi.klcp")) {
     std::filesystem::remove(fn + ".fmsi.klcp");
   }
+  if (std::filesystem::exists(fn + ".fmsi.isa")) {
+    std::filesystem::remove(fn + ".fmsi.isa");
+  }
   std::cerr << "Cleaned " << fn << std::endl;
   return 0;
 }
@@ -676,6 +1419,8 @@ int main(int argc, char *argv[]) {
     ret = ms_query(argc - 1, argv + 1, false);
   else if (op == "lookup")
     ret = ms_query(argc - 1, argv + 1, true);
+  else if (op == "filter")
+    ret = ms_filter(argc - 1, argv + 1);
   else if (op == "clean")
     ret = ms_clean(argc - 1, argv + 1);
   else if (op == "merge")
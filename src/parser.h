@@ -1,9 +1,21 @@
 #pragma once
 
 #include "kseq.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
 #include <stdexcept>
 #include <stdio.h>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <zlib.h>
 #include <vector>
 #include "kmers.h"
@@ -27,6 +39,446 @@ gzFile OpenFile(std::string &path) {
 }
 
 
+/// A queue of at most [capacity] items passed from a producer thread to a consumer thread.
+template <typename T>
+struct bounded_queue {
+    explicit bounded_queue(size_t capacity) : capacity(capacity) {}
+
+    /// Add the item; wait while the queue is full.
+    void push(T &&item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]() { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    /// Take the oldest item; wait while the queue is empty. Return false if it is empty and closed.
+    bool pop(T &item) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+            if (items.empty()) return false;
+            item = std::move(items.front());
+            items.pop_front();
+        }
+        not_full.notify_one();
+        return true;
+    }
+
+    /// Mark that no more items will be added.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+};
+
+/// Writes buffers to a file or stdout on a background thread, so that the (optional gzip) compression overlaps with the
+/// work of the calling thread. At most a few buffers wait to be written, so that the memory stays bounded.
+struct background_writer {
+    explicit background_writer(const std::string &path, bool compress) : path(path == "-" ? "stdout" : path) {
+        FILE *out_stream = path == "-" ? stdout : fopen(path.c_str(), "wb");
+        if (out_stream == nullptr) {
+            throw std::invalid_argument("couldn't open file " + path + " for writing");
+        }
+        if (compress) {
+            fflush(out_stream);
+            gz = gzdopen(dup(fileno(out_stream)), "wb6");
+            if (out_stream != stdout) fclose(out_stream);
+            if (gz == nullptr) {
+                throw std::invalid_argument("couldn't open file " + path + " for compressed writing");
+            }
+        } else {
+            file = out_stream;
+        }
+        thread = std::thread([this]() { run(); });
+    }
+
+    background_writer(const background_writer&) = delete;
+    background_writer& operator=(const background_writer&) = delete;
+
+    ~background_writer() {
+        close();
+    }
+
+    /// Queue the buffer to be written; wait if too many buffers are already queued.
+    void write(std::string &&buffer) {
+        queue.push(std::move(buffer));
+    }
+
+    /// Write all queued buffers and close the output; return false if any write or the closing failed, see error().
+    bool close() {
+        if (!thread.joinable()) return first_error.empty();
+        queue.close();
+        thread.join();
+        bool closed;
+        if (gz) closed = gzclose(gz) == Z_OK;
+        else if (file == stdout) closed = fflush(file) == 0;
+        else closed = fclose(file) == 0;
+        if (!closed) record_error("couldn't close");
+        return first_error.empty();
+    }
+
+    /// The first error of writing the output, or an empty string if there was none.
+    const std::string& error() const {
+        return first_error;
+    }
+
+private:
+    std::string path;
+    gzFile gz = nullptr;
+    FILE *file = nullptr;
+    bounded_queue<std::string> queue {4};
+    std::thread thread;
+    /// Written by the writing thread and read only after it is joined.
+    std::string first_error;
+
+    void record_error(const std::string &action) {
+        if (first_error.empty()) first_error = action + " " + path + ": " + strerror(errno);
+    }
+
+    void run() {
+        std::string buffer;
+        while (queue.pop(buffer)) {
+            // The remaining buffers are only dequeued after an error, so that the producer does not wait for them.
+            if (!first_error.empty() || buffer.empty()) continue;
+            bool written;
+            if (gz) written = gzwrite(gz, buffer.data(), buffer.size()) == (int) buffer.size();
+            else written = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+            if (!written) record_error("couldn't write to");
+        }
+    }
+};
+
+/// Call [read_batch] on a background thread until it returns false and [process_batch] on the calling thread for each
+/// batch read, so that the decompression and parsing of the input overlap with the processing of the previous batches.
+template <typename batch_t, typename read_batch_t, typename process_batch_t>
+void process_batches_in_pipeline(read_batch_t read_batch, process_batch_t process_batch) {
+    // Two batches wait at most, so that the reading may stall the processing only if it is slower anyway.
+    bounded_queue<batch_t> queue(2);
+    std::thread reader([&]() {
+        while (true) {
+            batch_t batch;
+            if (!read_batch(batch)) break;
+            queue.push(std::move(batch));
+        }
+        queue.close();
+    });
+    batch_t batch;
+    while (queue.pop(batch)) {
+        process_batch(batch);
+    }
+    reader.join();
+}
+
+/// A read-only memory mapping of a whole uncompressed regular file, so that its records can be parsed in place
+/// without copying them through the buffers of zlib and kseq.
+struct mapped_file {
+    const char *data = nullptr;
+    size_t size = 0;
+
+    mapped_file() = default;
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+        if (data != nullptr) munmap((void *) data, size);
+    }
+
+    /// Map the file at [path] if it is a regular file which is not gzipped; return whether it is mapped.
+    bool open(const std::string &path) {
+        if (path == "-") return false;
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat status;
+        unsigned char magic[2];
+        bool regular = fstat(fd, &status) == 0 && S_ISREG(status.st_mode);
+        bool gzipped = pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+        if (regular && !gzipped && status.st_size > 0) {
+            void *mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+                data = (const char *) mapping;
+                size = status.st_size;
+            }
+        }
+        close(fd);
+        mapped = regular && !gzipped && (data != nullptr || status.st_size == 0);
+        return mapped;
+    }
+
+    bool is_open() const { return mapped; }
+
+private:
+    bool mapped = false;
+};
+
+/// Reads the records of FASTA/FASTQ files like kseq_read, but the sequence of each record in windows of at most
+/// [window_length] characters, so that the memory does not depend on the length of the records.
+/// Consecutive windows of a record overlap by [overlap] characters, so that every k-mer with k <= overlap + 1 is in a window.
+/// From a mapped file, the windows of records with single-line sequences point directly into the mapping, and only
+/// multi-line sequences are stitched together in a buffer.
+struct windowed_reader {
+    size_t window_length;
+    size_t overlap;
+    /// The current window.
+    const char *window = nullptr;
+    size_t window_size = 0;
+    /// Whether the window is the first and whether it is the last of its record.
+    bool first = true, last = true;
+
+    windowed_reader(kseq_t *seq, size_t window_length, size_t overlap)
+        : window_length(std::max(window_length, overlap + 1)), overlap(overlap), seq(seq) {}
+
+    windowed_reader(const mapped_file &file, size_t window_length, size_t overlap)
+        : window_length(std::max(window_length, overlap + 1)), overlap(overlap),
+          cursor(file.data), end(file.data + file.size) {}
+
+    /// Whether the current window points into the mapped file, so that it stays valid after reading the next one.
+    bool in_mapping() const {
+        return in_place;
+    }
+
+    /// The name of the record of the current window.
+    std::string_view name() const {
+        return seq ? std::string_view(seq->name.s, seq->name.l) : mapped_name;
+    }
+
+    /// Read the next window and return its length, or a negative number with the meaning as in kseq_read at the end.
+    int64_t read() {
+        if (last) {
+            int64_t r = seq ? read_header() : read_mapped_header();
+            if (r < 0) return r;
+            first = true;
+            line_start = true;
+            record_length = 0;
+            buffer.clear();
+            if (!seq) {
+                in_place = find_single_line_sequence();
+                if (in_place && cursor < end && *cursor == '+' && !skip_mapped_quality()) return -2;
+            }
+        } else {
+            first = false;
+            if (!in_place) buffer.erase(0, buffer.size() - overlap);
+        }
+        if (in_place) {
+            window = first ? sequence_begin : window + window_size - overlap;
+            window_size = std::min(window_length, (size_t)(sequence_end - window));
+            last = window + window_size == sequence_end;
+            return window_size;
+        }
+        int sequence_end_char = seq ? read_sequence() : read_mapped_sequence();
+        if (sequence_end_char == '+' && !(seq ? skip_quality() : skip_mapped_quality())) return -2;
+        last = sequence_end_char != 0;
+        window = buffer.data();
+        window_size = buffer.size();
+        return window_size;
+    }
+
+private:
+    kseq_t *seq = nullptr;
+    /// The unread part of the mapped file.
+    const char *cursor = nullptr, *end = nullptr;
+    std::string_view mapped_name;
+    /// The single-line sequence of the current record in the mapped file, if it is read in place.
+    bool in_place = false;
+    const char *sequence_begin = nullptr, *sequence_end = nullptr;
+    /// The window of multi-line sequences.
+    std::string buffer;
+    /// The number of sequence characters of the current record read so far.
+    size_t record_length = 0;
+    /// Whether the next character starts a line.
+    bool line_start = true;
+
+    /// The end of the line starting at [p] in the mapped file, i.e., its newline or the end of the file.
+    const char *line_end(const char *p) const {
+        auto newline = (const char *) memchr(p, '\n', end - p);
+        return newline ? newline : end;
+    }
+
+    int64_t read_header() {
+        int c;
+        kstream_t *ks = seq->f;
+        if (seq->last_char == 0) {
+            while ((c = ks_getc(ks)) >= 0 && c != '>' && c != '@');
+            if (c < 0) return c;
+            seq->last_char = c;
+        }
+        seq->comment.l = 0;
+        int64_t r = ks_getuntil(ks, 0, &seq->name, &c);
+        if (r < 0) return r;
+        if (c != '\n') ks_getuntil(ks, KS_SEP_LINE, &seq->comment, 0);
+        return 0;
+    }
+
+    int64_t read_mapped_header() {
+        while (cursor < end && *cursor != '>' && *cursor != '@') ++cursor;
+        if (cursor == end || ++cursor == end) return -1;
+        const char *name_end = cursor;
+        while (name_end < end && !isspace((unsigned char) *name_end)) ++name_end;
+        mapped_name = std::string_view(cursor, name_end - cursor);
+        cursor = name_end == end || *name_end == '\n' ? name_end : line_end(name_end);
+        if (cursor < end) ++cursor;
+        return 0;
+    }
+
+    /// If the sequence of the record in the mapped file is a single line, point to it, move the cursor after it
+    /// and return true; otherwise keep the cursor at the start of the sequence and return false.
+    bool find_single_line_sequence() {
+        const char *begin = cursor;
+        while (begin < end && *begin == '\n') ++begin;
+        bool empty = begin == end || *begin == '>' || *begin == '@' || *begin == '+';
+        const char *newline = empty ? begin : line_end(begin);
+        const char *next = newline;
+        while (next < end && *next == '\n') ++next;
+        if (next < end && *next != '>' && *next != '@' && *next != '+') return false;
+        sequence_begin = begin;
+        sequence_end = newline;
+        // Windows line endings.
+        if (newline < end && sequence_end > sequence_begin && sequence_end[-1] == '\r') --sequence_end;
+        record_length = sequence_end - sequence_begin;
+        cursor = next;
+        return true;
+    }
+
+    /// Append sequence characters to the window until it is full; return 0 if the record continues afterwards,
+    /// '+' at its quality string, and -1 otherwise.
+    int read_sequence() {
+        kstream_t *ks = seq->f;
+        int c;
+        while ((c = ks_getc(ks)) >= 0) {
+            if (c == '\n') {
+                // Windows line endings.
+                if (!line_start && !buffer.empty() && buffer.back() == '\r') {
+                    buffer.pop_back();
+                    --record_length;
+                }
+                line_start = true;
+                continue;
+            }
+            if (line_start && (c == '>' || c == '+' || c == '@')) {
+                if (c != '+') seq->last_char = c;
+                return c == '+' ? '+' : -1;
+            }
+            if (buffer.size() == window_length) {
+                // The character belongs to the next window.
+                --ks->begin;
+                return 0;
+            }
+            // Copy the rest of the line in the buffer, up to the free space of the window.
+            --ks->begin;
+            size_t available = ks->end - ks->begin;
+            auto newline = (unsigned char *) memchr(ks->buf + ks->begin, '\n', available);
+            size_t length = std::min(newline ? (size_t)(newline - ks->buf - ks->begin) : available, window_length - buffer.size());
+            buffer.append((char *) ks->buf + ks->begin, length);
+            ks->begin += length;
+            record_length += length;
+            line_start = false;
+        }
+        seq->last_char = 0;
+        return -1;
+    }
+
+    /// The same as read_sequence, from the mapped file; the cursor stays at the character ending the sequence.
+    int read_mapped_sequence() {
+        while (cursor < end) {
+            char c = *cursor;
+            if (c == '\n') {
+                if (!line_start && !buffer.empty() && buffer.back() == '\r') {
+                    buffer.pop_back();
+                    --record_length;
+                }
+                line_start = true;
+                ++cursor;
+                continue;
+            }
+            if (line_start && (c == '>' || c == '+' || c == '@')) {
+                return c == '+' ? '+' : -1;
+            }
+            if (buffer.size() == window_length) return 0;
+            size_t length = std::min((size_t)(line_end(cursor) - cursor), window_length - buffer.size());
+            buffer.append(cursor, length);
+            cursor += length;
+            record_length += length;
+            line_start = false;
+        }
+        return -1;
+    }
+
+    /// Skip the quality string of the record; return false if it is missing or shorter than the sequence.
+    bool skip_quality() {
+        kstream_t *ks = seq->f;
+        int c;
+        while ((c = ks_getc(ks)) >= 0 && c != '\n');
+        if (c == -1) return false;
+        size_t quality_length = 0;
+        seq->qual.l = 0;
+        while (quality_length < record_length && ks_getuntil(ks, KS_SEP_LINE, &seq->qual, 0) >= 0) {
+            quality_length += seq->qual.l;
+        }
+        seq->last_char = 0;
+        return quality_length >= record_length;
+    }
+
+    /// The same as skip_quality, from the mapped file with the cursor at the '+'.
+    bool skip_mapped_quality() {
+        cursor = line_end(cursor);
+        if (cursor == end) return false;
+        ++cursor;
+        size_t quality_length = 0;
+        while (quality_length < record_length && cursor < end) {
+            const char *newline = line_end(cursor);
+            size_t length = newline - cursor;
+            if (length > 1 && newline[-1] == '\r') --length;
+            quality_length += length;
+            cursor = newline == end ? end : newline + 1;
+        }
+        return quality_length >= record_length;
+    }
+};
+
+/// Reads a list of k-mers with one k-mer and an optional identifier separated by whitespace on each line,
+/// in place from a mapped file or line by line through kseq.
+struct kmer_list_reader {
+    explicit kmer_list_reader(kseq_t *seq) : seq(seq) {}
+    explicit kmer_list_reader(const mapped_file &file) : cursor(file.data), end(file.data + file.size) {}
+
+    /// Read the next line into [kmer] and [id], which are valid until the next call; return false at the end.
+    bool read(std::string_view &kmer, std::string_view &id) {
+        std::string_view line;
+        if (seq) {
+            if (ks_getuntil(seq->f, KS_SEP_LINE, &seq->seq, 0) < 0) return false;
+            line = std::string_view(seq->seq.s, seq->seq.l);
+        } else {
+            if (cursor == end) return false;
+            auto newline = (const char *) memchr(cursor, '\n', end - cursor);
+            line = std::string_view(cursor, (newline ? newline : end) - cursor);
+            cursor = newline ? newline + 1 : end;
+        }
+        // Windows line endings.
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        size_t kmer_end = std::min(line.find_first_of(" \t"), line.size());
+        kmer = line.substr(0, kmer_end);
+        size_t id_begin = std::min(line.find_first_not_of(" \t", kmer_end), line.size());
+        id = line.substr(id_begin);
+        return true;
+    }
+
+private:
+    kseq_t *seq = nullptr;
+    /// The unread part of the mapped file.
+    const char *cursor = nullptr, *end = nullptr;
+};
+
 /// Obtain k based on the mask convention of k-1 trailing zeros.
 int infer_k(std::string ms) {
     int k = 1;
@@ -55,10 +507,5 @@ std::string read_masked_superstring(std::string fn) {
 }
 
 size_t next_invalid_character_or_end(char* sequence, size_t length) {
-    for (size_t i = 0; i < length; ++i) {
-        if (nucleotideToInt[(uint8_t)sequence[i]] == 4) {
-            return i;
-        }
-    }
-    return length;
+    return NextInvalidNucleotide(sequence, length);
 }
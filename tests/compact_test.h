@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../src/compact.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+    /// The sorted canonical k-mers of the superstring represented under f, counted by a map.
+    std::vector<camel::kmer_t> count_k_mers_naively(const std::string &superstring, const std::vector<bool> &mask, int k, demasking_function_t f) {
+        std::map<camel::kmer_t, std::pair<size_t, size_t>> counts;
+        for (size_t i = 0; i + k <= superstring.size(); ++i) {
+            camel::kmer_t k_mer = 0, rc_k_mer = 0;
+            for (int j = 0; j < k; ++j) {
+                k_mer = (k_mer << 2) | camel::kmer_t(camel::NucleotideToInt(superstring[i + j]));
+                rc_k_mer = (rc_k_mer << 2) | camel::kmer_t(3 - camel::NucleotideToInt(superstring[i + k - 1 - j]));
+            }
+            auto &[ones, total] = counts[std::min(k_mer, rc_k_mer)];
+            ones += mask[i];
+            ++total;
+        }
+        std::vector<camel::kmer_t> ret;
+        for (auto &[k_mer, count] : counts) {
+            if (f(count.first, count.second)) ret.push_back(k_mer);
+        }
+        return ret;
+    }
+
+    /// The sorted canonical k-mers of the concatenated inputs under f, counted once per input by a map.
+    std::vector<camel::kmer_t> count_k_mers_per_input_naively(const std::string &superstring, const std::vector<bool> &mask, int k,
+                                                             demasking_function_t f, const k_mer_inputs &inputs) {
+        std::map<camel::kmer_t, std::map<size_t, bool>> occurrences;
+        size_t input = 0;
+        for (size_t i = 0; i + k <= superstring.size(); ++i) {
+            camel::kmer_t k_mer = 0, rc_k_mer = 0;
+            for (int j = 0; j < k; ++j) {
+                k_mer = (k_mer << 2) | camel::kmer_t(camel::NucleotideToInt(superstring[i + j]));
+                rc_k_mer = (rc_k_mer << 2) | camel::kmer_t(3 - camel::NucleotideToInt(superstring[i + k - 1 - j]));
+            }
+            while (inputs.ends[input] <= i) ++input;
+            bool &is_set = occurrences[std::min(k_mer, rc_k_mer)][input];
+            is_set = is_set || mask[i];
+        }
+        std::vector<camel::kmer_t> ret;
+        for (auto &[k_mer, inputs_of_k_mer] : occurrences) {
+            size_t ones = 0, total = 0;
+            for (auto [input_of_k_mer, is_set] : inputs_of_k_mer) {
+                ones += is_set * inputs.weights[input_of_k_mer];
+                total += inputs.weights[input_of_k_mer];
+            }
+            if (f(ones, total)) ret.push_back(k_mer);
+        }
+        return ret;
+    }
+
+    TEST(COMPACT, RADIX_SORT) {
+        std::mt19937_64 rng(7);
+        std::vector<uint64_t> buffer;
+        // Sizes around the cutoff below which the keys are sorted by std::sort.
+        for (size_t size : {0, 1, 255, 256, 257, 5000}) {
+            for (int bits : {1, 8, 13, 57, 64}) {
+                std::vector<uint64_t> keys(size);
+                for (auto &key : keys) key = bits == 64 ? rng() : rng() & ((uint64_t(1) << bits) - 1);
+                auto want_result = keys;
+                std::sort(want_result.begin(), want_result.end());
+
+                radix_sort(keys.data(), keys.size(), bits, buffer);
+
+                EXPECT_EQ(keys, want_result);
+            }
+        }
+    }
+
+    TEST(COMPACT, COUNT_K_MERS) {
+        std::mt19937 rng(11);
+        std::string directory = std::filesystem::temp_directory_path();
+        // Below k = 4, the buckets are given by all bits of the k-mers.
+        for (int k : {1, 2, 3, 4, 5, 31, 32}) {
+            for (size_t length : {(size_t)k - 1, (size_t)k, (size_t)3000}) {
+                std::string superstring(length, 'A');
+                std::vector<bool> mask(length);
+                for (size_t i = 0; i < length; ++i) {
+                    superstring[i] = "ACGT"[rng() % 4];
+                    mask[i] = rng() % 2;
+                }
+                for (auto f : {mask_function("or", true), mask_function("xor", true), mask_function("1-1", true)}) {
+                    auto want_result = count_k_mers_naively(superstring, mask, k, f);
+
+                    EXPECT_EQ(count_k_mers(superstring, mask, k, f), want_result);
+                    EXPECT_EQ(count_k_mers(superstring, mask, k, f, directory), want_result);
+                }
+            }
+        }
+    }
+
+    TEST(COMPACT, COUNT_K_MERS_PER_INPUT) {
+        std::mt19937 rng(13);
+        std::string directory = std::filesystem::temp_directory_path();
+        // 300 inputs do not fit next to the 32-mers in the keys without more buckets.
+        for (int k : {3, 31, 32}) {
+            for (size_t input_count : {1, 3, 300}) {
+                // Few distinct nucleotides make the inputs share k-mers.
+                std::string superstring;
+                std::vector<bool> mask;
+                k_mer_inputs inputs;
+                for (size_t input = 0; input < input_count; ++input) {
+                    size_t length = k + rng() % 40;
+                    for (size_t i = 0; i < length; ++i) {
+                        superstring += "ACGT"[rng() % (k > 3 ? 2 : 4)];
+                        mask.push_back(rng() % 2);
+                    }
+                    inputs.ends.push_back(superstring.size());
+                    inputs.weights.push_back(input ? 2 : 1);
+                }
+                for (auto f : {mask_function("or", true), mask_function("1-1", true), mask_function("and", true)}) {
+                    auto want_result = count_k_mers_per_input_naively(superstring, mask, k, f, inputs);
+
+                    EXPECT_EQ(count_k_mers(superstring, mask, k, f, "", inputs), want_result);
+                    EXPECT_EQ(count_k_mers(superstring, mask, k, f, directory, inputs), want_result);
+                }
+            }
+        }
+    }
+
+    TEST(COMPACT, NORMALIZE) {
+        std::mt19937 rng(17);
+        // The k-mers of 32 nucleotides fill the whole word.
+        for (int k : {5, 31, 32}) {
+            std::string ms;
+            for (int i = 0; i < 2000; ++i) ms += "ACGTacgt"[rng() % 8];
+            auto [mask, superstring] = separate_mask_and_superstring(ms);
+            auto want_result = count_k_mers(superstring, mask, k, mask_function("or", true));
+
+            auto [normalized_mask, normalized_superstring] = separate_mask_and_superstring(normalize(ms, k, mask_function("or", true)));
+
+            EXPECT_EQ(count_k_mers(normalized_superstring, normalized_mask, k, mask_function("or", true)), want_result);
+        }
+    }
+}
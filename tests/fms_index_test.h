@@ -68,6 +68,27 @@ namespace {
         return ret;
     }
 
+    std::string pseudorandom_nucleotides(size_t length, uint64_t seed) {
+        std::string ret(length, 'A');
+        for (auto &c : ret) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            c = "ACGT"[seed >> 62];
+        }
+        return ret;
+    }
+
+    /// Index the k-mers of [both_strands] together with their reverse complements and the reverse complements of the k-mers
+    /// of [reverse_only], so that the orders of the former depend on the strand searched first and the latter train the
+    /// strand predictor to search the reverse strand first.
+    fms_index get_two_strand_index(const std::string& both_strands, const std::string& reverse_only, int k, bool use_klcp = false) {
+        auto rc_both_strands = ReverseComplementString(both_strands.data(), both_strands.size());
+        auto rc_reverse_only = ReverseComplementString(reverse_only.data(), reverse_only.size());
+        std::string ms = both_strands + std::string(rc_both_strands, both_strands.size()) + std::string(rc_reverse_only, reverse_only.size());
+        delete[] rc_both_strands;
+        delete[] rc_reverse_only;
+        return construct<uint64_t>(ms, k, use_klcp);
+    }
+
     TEST(FMS_INDEX, RANK) {
         auto index = get_dummy_index();
         struct test_case {
@@ -195,6 +216,60 @@ namespace {
         }
     }
 
+    TEST(FMS_INDEX, GET_RANGE_WITH_PATTERN_FIXED_K) {
+        auto index = get_dummy_index3();
+        struct test_case {
+            std::string pattern;
+            size_t want_i;
+            size_t want_j;
+            int want_mismatch;
+        };
+        std::vector<test_case> tests = {
+                {"ACA", 1, 3, -1},
+                {"CAC", 4, 6, -1},
+                {"CAT", 6, 7, -1},
+                {"AAA", 1, 1, 1},
+                {"TAC", 8, 8, 0},
+        };
+
+        for (auto t: tests) {
+            auto pattern = (char*) t.pattern.data();
+            size_t i, j;
+
+            int got_mismatch = search_pattern<3>(index, i, j, pattern, 3);
+
+            EXPECT_EQ(i, t.want_i);
+            EXPECT_EQ(j, t.want_j);
+            EXPECT_EQ(got_mismatch, t.want_mismatch);
+            EXPECT_EQ(get_range_with_pattern(index, i, j, pattern, 3), t.want_mismatch);
+        }
+    }
+
+    TEST(FMS_INDEX, GET_RANGE_WITH_PATTERN_CACHED) {
+        auto index = get_dummy_index3();
+        suffix_range_cache cache(4, 2);
+        std::vector<std::string> patterns = {"ACA", "CAC", "CAT", "AAA", "TAC", "GAC", "ACA", "TAA", "CA"};
+        for (int round = 0; round < 2; ++round) {
+            for (auto pattern : patterns) {
+                size_t want_i, want_j, got_i, got_j;
+                index.range_cache = nullptr;
+                int want_mismatch = get_range_with_pattern(index, want_i, want_j, pattern.data(), pattern.size());
+                index.range_cache = &cache;
+                int got_mismatch = get_range_with_pattern(index, got_i, got_j, pattern.data(), pattern.size());
+
+                EXPECT_EQ(got_mismatch, want_mismatch);
+                if (want_mismatch < 0) {
+                    EXPECT_EQ(got_i, want_i);
+                    EXPECT_EQ(got_j, want_j);
+                } else {
+                    EXPECT_EQ(got_i, got_j);
+                }
+            }
+        }
+        EXPECT_EQ(cache.lookups, 2 * patterns.size());
+        EXPECT_GE(cache.hits, patterns.size());
+    }
+
     TEST(FMS_INDEX, KMER_ORDER_IF_PRESENT) {
         auto index = get_dummy_index3();
         struct test_case {
@@ -220,6 +295,32 @@ namespace {
     }
 
 
+    TEST(FMS_INDEX, COUNT_ONES_IN_RANGE) {
+        auto index = get_dummy_index3();
+        struct test_case {
+            size_t sa_start;
+            size_t sa_end;
+            size_t want_ones;
+            int want_presence;
+        };
+        std::vector<test_case> tests = {
+            {1, 1, 0, -1},
+            {2, 3, 0, 0},
+            {1, 2, 1, 1},
+            {0, 8, 4, 1},
+            {4, 7, 3, 1},
+            {2, 4, 0, 0},
+            {7, 8, 0, 0},
+        };
+        for (auto t: tests) {
+            size_t got_ones = count_ones_in_range(index, t.sa_start, t.sa_end);
+            int got_presence = infer_presence<false>(index, t.sa_start, t.sa_end);
+
+            EXPECT_EQ(got_ones, t.want_ones);
+            EXPECT_EQ(got_presence, t.want_presence);
+        }
+    }
+
     TEST(FMS_INDEX, QUERY_KMERS_STREAMING) {
         auto index = get_dummy_index3();
         struct test_case {
@@ -237,14 +338,16 @@ namespace {
         for (auto t: tests) {
             auto sequence = (char*) t.query.data();
             auto rc = ReverseComplementString(t.query.data(), t.query.length());
-            std::stringstream got_result;
+            std::vector<int64_t> result (t.query.length() - t.k + 1);
 
             if (t.maximize_ones)
-                query_kmers_streaming<true>(index, sequence, rc, t.query.length(), t.k, false, got_result);
+                query_kmers_streaming<true>(index, sequence, rc, t.query.length(), t.k, false, result.data());
             else
-                query_kmers_streaming<false>(index, sequence, rc, t.query.length(), t.k, false, got_result);
+                query_kmers_streaming<false>(index, sequence, rc, t.query.length(), t.k, false, result.data());
+            std::string got_result;
+            append_query_results(got_result, result.data(), result.size(), false);
 
-            EXPECT_EQ(got_result.str(), t.want_result);
+            EXPECT_EQ(got_result, t.want_result);
         }
     }
 
@@ -264,17 +367,151 @@ namespace {
         for (auto t: tests) {
             auto sequence = (char*) t.query.data();
             auto rc = ReverseComplementString(t.query.data(), t.query.length());
-            std::stringstream got_result;
+            std::vector<int64_t> result (t.query.length() - t.k + 1);
 
             if (t.maximize_ones)
-                query_kmers_streaming<true>(index, sequence, rc, t.query.length(), t.k, true, got_result);
+                query_kmers_streaming<true>(index, sequence, rc, t.query.length(), t.k, true, result.data());
             else
-                query_kmers_streaming<false>(index, sequence, rc, t.query.length(), t.k, true, got_result);
+                query_kmers_streaming<false>(index, sequence, rc, t.query.length(), t.k, true, result.data());
+            std::string got_result;
+            append_query_results(got_result, result.data(), result.size(), true);
 
-            EXPECT_EQ(got_result.str(), t.want_result);
+            EXPECT_EQ(got_result, t.want_result);
+        }
+    }
+
+    TEST(FMS_INDEX, QUERY_KMERS_STREAMING_SEGMENTS) {
+        int k = 7;
+        std::string both_strands = pseudorandom_nucleotides(300, 8), reverse_only = pseudorandom_nucleotides(300, 9);
+        auto index = get_two_strand_index(both_strands, reverse_only, k, true);
+        // Several segments of k-mers found on one, both or no strands.
+        std::string query = reverse_only.substr(0, 100) + both_strands.substr(10, 80) + pseudorandom_nucleotides(40, 10)
+            + reverse_only.substr(150, 60) + both_strands.substr(200, 70);
+        size_t last = query.length() - k;
+
+        for (bool output_orders : {true, false}) {
+            auto rc = ReverseComplementString(query.data(), query.length());
+            // The new predictor searches the forward strand first and the reverse one only at the unresolved k-mers.
+            std::vector<int64_t> want (last + 1), got (last + 1);
+            for (size_t i = 0; i <= last; ++i) {
+                if (output_orders) {
+                    want[i] = single_query_order(index, query.data() + i, k);
+                    if (want[i] < 0) want[i] = single_query_order(index, rc + last - i, k);
+                } else {
+                    want[i] = std::max(single_query_or<false>(index, query.data() + i, k), single_query_or<false>(index, rc + last - i, k));
+                }
+            }
+            index.predictor = strand_predictor();
+            query_kmers_streaming<false>(index, query.data(), rc, query.length(), k, output_orders, got.data());
+
+            EXPECT_EQ(got, want);
+            delete[] rc;
+        }
+    }
+
+    TEST(FMS_INDEX, QUERY_KMERS_SKIPPING) {
+        auto index = get_dummy_index3();
+        struct test_case {
+            std::string query;
+            bool output_orders;
+            std::string want_result;
+        };
+        std::vector<test_case> tests = {
+                {"CACATACA", false, "111001"},
+                {"TGTATGTG", false, "100111"},
+                {"CACATTGT", false, "111001"},
+                {"AAAACACA", false, "000111"},
+                {"CACATACA", true, "1,0,3,-1,-1,0"},
+                {"TGTATGTG", true, "0,-1,-1,3,0,1"},
+        };
+        for (auto t: tests) {
+            auto sequence = (char*) t.query.data();
+            auto rc = ReverseComplementString(t.query.data(), t.query.length());
+            std::vector<int64_t> result (t.query.length() - 2);
+            query_scratch scratch;
+
+            query_kmers_skipping<false>(index, sequence, rc, t.query.length(), 3, false, t.output_orders, scratch, result.data());
+            std::string got_result;
+            append_query_results(got_result, result.data(), result.size(), t.output_orders);
+
+            EXPECT_EQ(got_result, t.want_result);
+            delete[] rc;
+        }
+    }
+
+    TEST(FMS_INDEX, QUERY_KMERS_SKIPPING_AS_SINGLE) {
+        int k = 7;
+        std::string both_strands = pseudorandom_nucleotides(300, 1), reverse_only = pseudorandom_nucleotides(300, 2);
+        auto index = get_two_strand_index(both_strands, reverse_only, k);
+        std::string query = reverse_only.substr(0, 60) + both_strands.substr(10, 60) + "ACGTACGTAC"
+            + reverse_only.substr(100, 40) + both_strands.substr(200, 50);
+
+        for (bool output_orders : {true, false}) {
+            auto rc = ReverseComplementString(query.data(), query.length());
+            std::vector<int64_t> want (query.length() - k + 1), got (query.length() - k + 1);
+            query_scratch scratch;
+            index.predictor = strand_predictor();
+            query_kmers_single<query_mode::orr>(index, query.data(), rc, query.length(), k, want.data(), output_orders, demasking_function_t());
+            index.predictor = strand_predictor();
+            query_kmers_skipping<false>(index, query.data(), rc, query.length(), k, false, output_orders, scratch, got.data());
+
+            EXPECT_EQ(got, want);
+            delete[] rc;
+        }
+    }
+
+    TEST(FMS_INDEX, QUERY_KMERS_SKIPPING_AS_STREAMING) {
+        int k = 7;
+        std::string both_strands = pseudorandom_nucleotides(300, 3), reverse_only = pseudorandom_nucleotides(300, 4);
+        auto index = get_two_strand_index(both_strands, reverse_only, k, true);
+        // The chunks of reverse k-mers make the predictor swap the strands.
+        std::vector<std::string> chunks = {reverse_only.substr(0, 60), reverse_only.substr(70, 60), both_strands.substr(10, 60),
+            pseudorandom_nucleotides(50, 5), reverse_only.substr(150, 40) + both_strands.substr(200, 50), both_strands.substr(0, 40)};
+
+        for (bool output_orders : {true, false}) {
+            strand_predictor streaming_predictor, skipping_predictor;
+            for (auto& chunk : chunks) {
+                auto rc = ReverseComplementString(chunk.data(), chunk.length());
+                std::vector<int64_t> want (chunk.length() - k + 1), got (chunk.length() - k + 1);
+                query_scratch scratch;
+                index.predictor = streaming_predictor;
+                query_kmers_streaming<false>(index, chunk.data(), rc, chunk.length(), k, output_orders, want.data());
+                streaming_predictor = index.predictor;
+                index.predictor = skipping_predictor;
+                query_kmers_skipping<false>(index, chunk.data(), rc, chunk.length(), k, true, output_orders, scratch, got.data());
+                skipping_predictor = index.predictor;
+
+                EXPECT_EQ(got, want);
+                EXPECT_EQ(skipping_predictor.score, streaming_predictor.score);
+                delete[] rc;
+            }
         }
     }
 
+    TEST(FMS_INDEX, QUERY_PLANNER) {
+        int64_t found[64], missing[64];
+        std::fill(found, found + 64, 1);
+        std::fill(missing, missing + 64, -1);
+        size_t index_size = 1 << 22;
+        query_planner planner;
+        for (int i = 0; i < 10; ++i) planner.log_results(missing, 64, false);
+        EXPECT_LT(planner.hit_rate, 0.01);
+        // Missing k-mers are skipping even with the kLCP array, which resets the streamed ranges at each of them.
+        EXPECT_EQ(planner.choose(true, 31, index_size, 0), query_strategy::skipping);
+        EXPECT_EQ(planner.choose(false, 31, index_size, 0), query_strategy::skipping);
+        EXPECT_GT(planner.max_chunk_length(150, 31), 31 + 300);
+
+        for (int i = 0; i < 10; ++i) planner.log_results(found, 64, false);
+        EXPECT_GT(planner.hit_rate, 0.99);
+        EXPECT_EQ(planner.choose(true, 31, index_size, 0), query_strategy::streaming);
+        EXPECT_EQ(planner.choose(false, 31, index_size, 0), query_strategy::single);
+
+        EXPECT_EQ(planner.max_chunk_length(150, 31, false), 31 + 24);
+
+        planner.hit_rate = 0.5;
+        EXPECT_EQ(planner.max_chunk_length(150, 31), 31 + 24);
+    }
+
     TEST(FMS_INDEX, QUERY_ORDERS) {
         auto index = get_dummy_index();
         struct test_case {
@@ -353,6 +590,256 @@ namespace {
         }
     }
 
+    TEST(FMS_INDEX, QUERY_GENERAL) {
+        auto index = get_dummy_index3();
+        struct test_case {
+            std::string query;
+            std::string f_name;
+            std::string want_result;
+        };
+        std::vector<test_case> tests = {
+                {"CACATACA", "xor", "011001"},
+                {"TGTATGTG", "xor", "100110"},
+                {"CACATACA", "and", "101000"},
+                {"ACACA", "and", "010"},
+                {"CACATTGT", "or", "111001"},
+                {"TGTATGTG", "2-3", "000001"},
+                {"ACACA", "1-1", "101"},
+        };
+
+        for (auto t: tests) {
+            for (bool has_klcp : {false, true}) {
+                std::stringstream got_result;
+
+                with_demasking_functor(t.f_name, [&](auto f) {
+                    query_kmers<query_mode::general>(index, t.query.data(), t.query.length(), 3, has_klcp, got_result, false, f);
+                });
+
+                EXPECT_EQ(got_result.str(), t.want_result);
+            }
+        }
+    }
+
+    TEST(FMS_INDEX, QUERY_BATCH_RECORDS) {
+        auto index = get_dummy_index3();
+        std::vector<std::string> records = {"CACATACA", "CANATACA", "CA", "TGTATGTG"};
+        std::vector<std::string> want_result = {"111001", "000001", "", "100111"};
+        std::vector<std::string> want_orders = {"1,0,3,-1,-1,0", "-1,-1,-1,-1,-1,0", "", "0,-1,-1,3,0,1"};
+
+        for (bool has_klcp : {false, true}) {
+            for (bool output_orders : {false, true}) {
+                query_batch batch;
+                query_scratch scratch;
+                for (auto &record : records) {
+                    batch.add_record("name", record.data(), record.size());
+                }
+                query_batch_records<query_mode::orr>(index, batch, 3, has_klcp, output_orders, scratch);
+
+                ASSERT_EQ(batch.result_ends.size(), records.size());
+                for (size_t i = 0; i < records.size(); ++i) {
+                    size_t begin = i ? batch.result_ends[i - 1] : 0;
+                    std::string got_result;
+                    append_query_results(got_result, batch.results.data() + begin, batch.result_ends[i] - begin, output_orders);
+                    EXPECT_EQ(got_result, output_orders ? want_orders[i] : want_result[i]);
+                }
+            }
+        }
+    }
+
+    TEST(FMS_INDEX, CONTAINMENT_THRESHOLDS) {
+        containment_thresholds thresholds = {0.5, 0.8};
+        EXPECT_TRUE(thresholds.enabled());
+        EXPECT_FALSE(containment_thresholds().enabled());
+
+        EXPECT_FALSE(thresholds.decided(3, 4, 10));
+        EXPECT_TRUE(thresholds.decided(1, 7, 10));
+        EXPECT_FALSE(thresholds.satisfied(1, 7, 10));
+        EXPECT_TRUE(thresholds.decided(9, 9, 10));
+        EXPECT_FALSE(thresholds.satisfied(9, 9, 10));
+        EXPECT_TRUE(thresholds.decided(6, 8, 10));
+        EXPECT_TRUE(thresholds.satisfied(6, 8, 10));
+        EXPECT_TRUE(thresholds.decided(0, 0, 0));
+        EXPECT_FALSE(thresholds.satisfied(0, 0, 0));
+
+        containment_thresholds min_found = {0, 1, 3};
+        EXPECT_TRUE(min_found.enabled());
+        EXPECT_FALSE(min_found.decided(2, 5, 10));
+        EXPECT_TRUE(min_found.decided(3, 5, 10));
+        EXPECT_TRUE(min_found.satisfied(3, 5, 10));
+        EXPECT_TRUE(min_found.decided(0, 8, 10));
+        EXPECT_FALSE(min_found.satisfied(0, 8, 10));
+    }
+
+    TEST(FMS_INDEX, SUMMARIZE_RESULTS) {
+        std::vector<int64_t> results = {1, 1, 0, -1, 1, 1, 1, 0};
+        auto got_result = summarize_results(results.data(), results.size(), 10, false);
+        EXPECT_EQ(got_result.found, 5);
+        EXPECT_EQ(got_result.queried, 8);
+        EXPECT_EQ(got_result.total, 10);
+        EXPECT_EQ(got_result.longest_run, 3);
+
+        got_result = summarize_results(results.data(), results.size(), 8, true);
+        EXPECT_EQ(got_result.found, 7);
+        EXPECT_EQ(got_result.longest_run, 4);
+    }
+
+    TEST(FMS_INDEX, QUERY_BATCH_RECORDS_WITH_THRESHOLDS) {
+        auto index = get_dummy_index3();
+        std::string record;
+        for (int i = 0; i < 1000; ++i) record += "CA";
+        for (int i = 0; i < 1000; ++i) record += "GG";
+        size_t total = record.size() - 2;
+        struct test_case {
+            containment_thresholds thresholds;
+            bool want_early_stop;
+            bool want_satisfied;
+        };
+        std::vector<test_case> tests = {
+                {{0, 1}, false, true},
+                {{0.4, 1}, true, true},
+                {{0.9, 1}, true, false},
+                {{0, 0.3}, true, false},
+                {{0.45, 0.55}, false, true},
+        };
+
+        for (auto &t : tests) {
+            query_batch batch;
+            query_scratch scratch;
+            batch.add_record("name", record.data(), record.size());
+
+            query_batch_records<query_mode::orr>(index, batch, 3, false, false, scratch, t.thresholds);
+
+            ASSERT_EQ(batch.result_ends.size(), 1);
+            EXPECT_EQ(batch.result_counts[0], total);
+            auto summary = summarize_results(batch.results.data(), batch.result_ends[0], total, false);
+            EXPECT_EQ(summary.queried < total, t.want_early_stop);
+            EXPECT_EQ(t.thresholds.satisfied(summary.found, summary.queried, total), t.want_satisfied);
+            for (size_t i = 0; i < summary.queried; ++i) {
+                EXPECT_EQ(is_found(batch.results[i], false), i < 1998);
+            }
+        }
+    }
+
+    TEST(FMS_INDEX, QUERY_KMER_RECORDS) {
+        auto index = get_dummy_index3();
+        std::vector<std::string> records = {"CAC", "ACA", "AAA", "CAT", "ATG", "ACA", "TAC", "TGT", "aca"};
+        for (bool output_orders : {false, true}) {
+            query_batch batch;
+            query_scratch scratch;
+            for (auto &record : records) {
+                batch.add_record("name", record.data(), record.size());
+            }
+            query_batch_records<query_mode::orr>(index, batch, 3, false, output_orders, scratch);
+
+            ASSERT_EQ(scratch.kmer_records.size(), records.size());
+            for (size_t i = 0; i < records.size(); ++i) {
+                std::stringstream want_result;
+                query_kmers<query_mode::orr>(index, records[i].data(), 3, 3, false, want_result, output_orders);
+                std::string got_result;
+                append_query_results(got_result, batch.results.data() + i, 1, output_orders);
+                EXPECT_EQ(got_result, want_result.str());
+            }
+        }
+    }
+
+    TEST(FMS_INDEX, QUERY_KMER_RECORDS_AS_ORDERED) {
+        int k = 7;
+        std::string both_strands = pseudorandom_nucleotides(200, 3), reverse_only = pseudorandom_nucleotides(200, 4);
+        auto index = get_two_strand_index(both_strands, reverse_only, k);
+        std::vector<std::string> records;
+        for (size_t i = 0; i + k <= both_strands.size(); i += 3) {
+            records.push_back(reverse_only.substr(i, k));
+            records.push_back(both_strands.substr(i, k));
+        }
+
+        for (bool output_orders : {true, false}) {
+            query_batch bulk, ordered;
+            query_scratch scratch;
+            for (auto &record : records) {
+                bulk.add_record("name", record.data(), record.size());
+                ordered.add_record("name", record.data(), record.size());
+            }
+            // A record shorter than k makes the batch mixed, so it is queried in order.
+            ordered.add_record("name", "AC", 2);
+            index.predictor = strand_predictor();
+            query_batch_records<query_mode::orr>(index, bulk, k, false, output_orders, scratch);
+            ASSERT_EQ(scratch.kmer_records.size(), records.size());
+            index.predictor = strand_predictor();
+            query_batch_records<query_mode::orr>(index, ordered, k, false, output_orders, scratch);
+
+            ASSERT_EQ(ordered.results.size(), records.size());
+            EXPECT_EQ(bulk.results, ordered.results);
+        }
+    }
+
+    TEST(FMS_INDEX, QUERY_BORROWED_RECORDS) {
+        auto index = get_dummy_index3();
+        std::vector<std::string> records = {"CACATACA", "TGTATGTG", "AC", "CACANTTGT", "AAAACACA"};
+        query_batch copied, mixed;
+        query_scratch scratch;
+        for (size_t i = 0; i < records.size(); ++i) {
+            copied.add_record("name", records[i].data(), records[i].size());
+            if (i % 2) mixed.add_record("name", records[i].data(), records[i].size());
+            else mixed.add_borrowed_record("name", records[i].data(), records[i].size());
+        }
+        query_batch_records<query_mode::orr>(index, copied, 3, false, false, scratch);
+        query_batch_records<query_mode::orr>(index, mixed, 3, false, false, scratch);
+
+        EXPECT_EQ(mixed.sequences, records[1] + records[3]);
+        EXPECT_EQ(mixed.sequence(2), records[2].data());
+        EXPECT_EQ(mixed.sequence_length, copied.sequence_length);
+        EXPECT_EQ(mixed.results, copied.results);
+        EXPECT_EQ(mixed.result_ends, copied.result_ends);
+    }
+
+    TEST(FMS_INDEX, QUERY_ENCODED_KMERS) {
+        auto index = get_dummy_index3();
+        std::string nucleotides = "ACGT";
+        std::vector<std::string> kmers;
+        std::vector<uint64_t> encoded_kmers;
+        for (int code = 0; code < 64; ++code) {
+            std::string kmer;
+            for (int i = 2; i >= 0; --i) kmer += nucleotides[(code >> (2 * i)) & 3];
+            kmers.push_back(kmer);
+            encoded_kmers.push_back(code);
+        }
+        std::vector<__uint128_t> wide_encoded_kmers(encoded_kmers.begin(), encoded_kmers.end());
+        for (bool output_orders : {false, true}) {
+            std::vector<int64_t> got_result(kmers.size()), got_wide_result(kmers.size());
+            query_encoded_kmers<query_mode::orr>(index, encoded_kmers.data(), encoded_kmers.size(), 3, output_orders, got_result.data());
+            query_encoded_kmers<query_mode::orr>(index, wide_encoded_kmers.data(), wide_encoded_kmers.size(), 3, output_orders, got_wide_result.data());
+
+            for (size_t i = 0; i < kmers.size(); ++i) {
+                std::stringstream want_result;
+                query_kmers<query_mode::orr>(index, kmers[i].data(), 3, 3, false, want_result, output_orders);
+                std::string got, got_wide;
+                append_query_results(got, got_result.data() + i, 1, output_orders);
+                append_query_results(got_wide, got_wide_result.data() + i, 1, output_orders);
+                EXPECT_EQ(got, want_result.str());
+                EXPECT_EQ(got_wide, want_result.str());
+            }
+        }
+    }
+
+    TEST(FMS_INDEX, REENCODE_KMER_BY_SUFFIX) {
+        std::string kmer = "ACGTAC";
+        uint64_t encoded = 0b000110110001;
+        EXPECT_EQ(reencode_kmer_by_suffix<uint64_t>(encoded, 6, false), encode_kmer_by_suffix<uint64_t>(kmer.data(), 6, false));
+        EXPECT_EQ(reencode_kmer_by_suffix<uint64_t>(encoded, 6, true), encode_kmer_by_suffix<uint64_t>(kmer.data(), 6, true));
+        // Bits above the k-mer are ignored.
+        EXPECT_EQ(reencode_kmer_by_suffix<__uint128_t>(encoded | (__uint128_t(1) << 100), 6, true), encode_kmer_by_suffix<__uint128_t>(kmer.data(), 6, true));
+    }
+
+    TEST(FMS_INDEX, COMMON_SUFFIX_LENGTH) {
+        std::string a = "ACGTAC", b = "TTGTAC", c = "ACGTAG";
+        EXPECT_EQ(common_suffix_length(encode_kmer_by_suffix<uint64_t>(a.data(), 6, false), encode_kmer_by_suffix<uint64_t>(b.data(), 6, false), 6), 4);
+        EXPECT_EQ(common_suffix_length(encode_kmer_by_suffix<uint64_t>(a.data(), 6, false), encode_kmer_by_suffix<uint64_t>(a.data(), 6, false), 6), 6);
+        EXPECT_EQ(common_suffix_length(encode_kmer_by_suffix<__uint128_t>(a.data(), 6, false), encode_kmer_by_suffix<__uint128_t>(c.data(), 6, false), 6), 0);
+        // GTACGT is the reverse complement of ACGTAC.
+        std::string rc = "GTACGT";
+        EXPECT_EQ(encode_kmer_by_suffix<uint64_t>(a.data(), 6, true), encode_kmer_by_suffix<uint64_t>(rc.data(), 6, false));
+    }
+
     TEST (FMS_INDEX, CONSTRUCT) {
         std::string masked_superstring = "CaGGTag";
         fms_index index = construct<int64_t>(masked_superstring, 31, false);
@@ -400,6 +887,70 @@ namespace {
         EXPECT_EQ(got_result, want_result);
     }
 
+    TEST(FMS_INDEX, MERGE) {
+        struct test_case {
+            std::string a;
+            std::string b;
+            int k;
+            bool use_klcp;
+        };
+        std::vector<test_case> tests = {
+                {"CaGGTag", "ACgTAcg", 3, true},
+                // Suffixes of the first superstring which are prefixes of other suffixes or of the second superstring.
+                {"CACACat", "CAcGGT", 3, true},
+                {"ACgTACGTac", "acGTACgTACgt", 4, true},
+                {"AAAAAAAt", "AAAAc", 5, true},
+                {"GGTaGCA", "TTtGCAA", 2, false},
+                {"CAcACACACACACACACACACACAcaCACACACACACACACAca", "CAcACACACACACACACACACACACACACACACACACACacg", 40, true},
+                // The (k-1)-mers of the second superstring are kept only next to the suffixes of the first one.
+                {pseudorandom_nucleotides(50, 5), pseudorandom_nucleotides(500, 6) + "acgt", 5, true},
+        };
+
+        for (auto t: tests) {
+            auto a = construct<__uint128_t>(t.a, t.k, t.use_klcp);
+            auto b = construct<__uint128_t>(t.b, t.k, t.use_klcp);
+            std::string concatenation = t.a + t.b;
+            auto want_index = construct<__uint128_t>(concatenation, t.k, t.use_klcp);
+
+            auto index = merge(a, b);
+
+            EXPECT_EQ(index.ac_gt, want_index.ac_gt);
+            EXPECT_EQ(index.ac, want_index.ac);
+            EXPECT_EQ(index.gt, want_index.gt);
+            EXPECT_EQ(index.counts, want_index.counts);
+            EXPECT_EQ(index.dollar_position, want_index.dollar_position);
+            EXPECT_EQ(index.klcp, want_index.klcp);
+            ASSERT_EQ(index.sa_transformed_mask.size(), want_index.sa_transformed_mask.size());
+            for (size_t i = 0; i < index.sa_transformed_mask.size(); ++i) {
+                EXPECT_EQ(index.sa_transformed_mask[i], want_index.sa_transformed_mask[i]);
+            }
+            EXPECT_EQ(index.isa_samples, want_index.isa_samples);
+            EXPECT_EQ(export_ms(index), concatenation);
+        }
+    }
+
+    TEST(FMS_INDEX, EXPORT_MS_SAMPLED) {
+        // Superstrings spanning several sampled segments, the last of which ends exactly at a sampled position.
+        for (size_t length : {3 * ISA_SAMPLE_DISTANCE + 1234, 2 * ISA_SAMPLE_DISTANCE}) {
+            std::string ms(length, 'A');
+            uint64_t state = length;
+            for (auto &c : ms) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                c = "ACGTacgt"[state >> 61];
+            }
+            auto index = construct<uint64_t>(ms, 31, true);
+            ASSERT_TRUE(has_isa_samples(index));
+            EXPECT_EQ(export_ms(index), ms);
+
+            std::string first = ms.substr(0, ms.size() / 2 + 17), second = ms.substr(first.size());
+            auto a = construct<uint64_t>(first, 31, true);
+            auto b = construct<uint64_t>(second, 31, true);
+            auto merged = merge(a, b);
+            EXPECT_EQ(merged.isa_samples, index.isa_samples);
+            EXPECT_EQ(export_ms(merged), ms);
+        }
+    }
+
     TEST(FMS_INDEX, OBTAIN_KMER) {
         struct test_case {
             std::string masked_superstring;
@@ -7,19 +7,39 @@ mkdir -p $BIN
 
 $PROG index $TESTS/integration_a.fa
 $PROG index $TESTS/integration_b.fa
+$PROG index $TESTS/integration_c.fa
+cp $TESTS/integration_c.fa $BIN/integration_c_k4.fa
+$PROG index -k 4 $BIN/integration_c_k4.fa
 
 $PROG merge -p $TESTS/integration_a.fa -p $TESTS/integration_b.fa -r $BIN/merged.fa
+for op in union inter diff symdiff; do
+  $PROG $op -p $TESTS/integration_c.fa -p $TESTS/integration_a.fa -p $TESTS/integration_b.fa -r $BIN/$op.fa 2> /dev/null
+done
+$PROG union -p $TESTS/integration_a.fa -p $BIN/integration_c_k4.fa -r $BIN/union_k4.fa 2> /dev/null
+union_k4_status=$?
 
 $PROG query -k 3 -q $TESTS/queries.txt $TESTS/integration_a.fa > $BIN/a.txt 2> /dev/null
 $PROG lookup -k 3 -q $TESTS/queries.txt $TESTS/integration_a.fa > $BIN/a_hash.txt 2> /dev/null
+$PROG lookup -k 3 -q $TESTS/queries.txt -o /dev/full $TESTS/integration_a.fa 2> /dev/null
+full_status=$?
+$PROG query -k 3 -q $TESTS/queries.txt -o $BIN/a.txt.gz $TESTS/integration_a.fa 2> /dev/null
+$PROG lookup -k 3 -q $TESTS/queries.txt -o $BIN/a_hash.txt.gz $TESTS/integration_a.fa 2> /dev/null
 $PROG query -k 3 -q $TESTS/queries.txt -f xor $TESTS/integration_a.fa > $BIN/a_xor.txt 2> /dev/null
 $PROG query -k 3 -q $TESTS/queries.txt $TESTS/integration_b.fa > $BIN/b.txt 2> /dev/null
 $PROG query -k 3 -q $TESTS/queries.txt -f xor $TESTS/integration_b.fa > $BIN/b_xor.txt 2> /dev/null
 $PROG query -k 3 -q $TESTS/queries.txt $BIN/merged.fa > $BIN/merged.txt 2> /dev/null
 $PROG query -k 3 -q $TESTS/queries.txt -f xor $BIN/merged.fa > $BIN/merged_xor.txt 2> /dev/null
+for op in union inter diff symdiff; do
+  $PROG query -k 3 --kmer-list -q $TESTS/queries_sets.txt $BIN/$op.fa > $BIN/$op.txt 2> /dev/null
+done
+$PROG lookup -k 3 -q $TESTS/queries.txt --binary $BIN/a_binary $TESTS/integration_a.fa 2> /dev/null
+$PROG lookup -k 3 --kmer-list -q $TESTS/queries_list.txt $TESTS/integration_a.fa > $BIN/a_list_hash.txt 2> /dev/null
+$PROG filter -k 3 -q $TESTS/queries.txt $TESTS/integration_a.fa > $BIN/a_filter.fa 2> /dev/null
+$PROG filter -k 3 -q $TESTS/queries.txt --drop-matching --min-hits 2 -o $BIN/a_filter_drop2.fa.gz $TESTS/integration_a.fa 2> /dev/null
 
 #$PROG normalize -k 3 -p $BIN/merged.fa -s -l > $BIN/merged_normalized.fa 2> /dev/null
 $PROG normalize -k 3 -s $BIN/merged.fa > $BIN/merged_normalized2.fa 2> /dev/null
+$PROG normalize -k 3 -s -d $BIN $BIN/merged.fa > $BIN/merged_normalized_disk.fa 2> /dev/null
 
 
 
@@ -27,16 +47,39 @@ diff $TESTS/result_a_complements.txt $BIN/a.txt || exit 1
 echo "a.txt OK"
 diff $TESTS/result_a_complements_hash.txt $BIN/a_hash.txt || exit 1
 echo "a_hash.txt OK"
+gzip -dc $BIN/a.txt.gz | diff $TESTS/result_a_complements.txt - || exit 1
+echo "a.txt.gz OK"
+gzip -dc $BIN/a_hash.txt.gz | diff $TESTS/result_a_complements_hash.txt - || exit 1
+echo "a_hash.txt.gz OK"
+cut -f2 $TESTS/result_a_complements_hash.txt | tr ',' '\n' | diff - <(od -An -v -td4 -w4 $BIN/a_binary.orders | tr -d ' ') || exit 1
+cut -f1 $TESTS/result_a_complements_hash.txt | diff - $BIN/a_binary.names || exit 1
+echo "a_binary.orders OK"
+diff $TESTS/result_a_list_hash.txt $BIN/a_list_hash.txt || exit 1
+echo "a_list_hash.txt OK"
 diff $TESTS/result_b_complements.txt $BIN/b.txt || exit 1
 echo "b.txt OK"
 diff $TESTS/result_b_complements_xor.txt $BIN/b_xor.txt || exit 1
 echo "b_xor.txt OK"
 diff $TESTS/result_merged_complements.txt $BIN/merged.txt || exit 1
 echo "merged.txt OK"
+for op in union inter diff symdiff; do
+  diff $TESTS/result_$op.txt $BIN/$op.txt || exit 1
+  echo "$op.txt OK"
+done
+[ $union_k4_status -ne 0 ] || exit 1
+echo "union_k4 error OK"
+[ $full_status -ne 0 ] || exit 1
+echo "full output error OK"
+diff $TESTS/result_a_filter.fa $BIN/a_filter.fa || exit 1
+echo "a_filter.fa OK"
+gzip -dc $BIN/a_filter_drop2.fa.gz | diff $TESTS/result_a_filter_drop2.fa - || exit 1
+echo "a_filter_drop2.fa.gz OK"
 
 #diff $TESTS/result_normalized.txt $BIN/merged_normalized.fa
 diff $TESTS/result_normalized2.txt $BIN/merged_normalized2.fa || exit 1
 echo "merged_normalized2.fa OK"
+diff $TESTS/result_normalized2.txt $BIN/merged_normalized_disk.fa || exit 1
+echo "merged_normalized_disk.fa OK"
 
 echo "All tests passed"
 
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <random>
+#include <string>
+
+#include "../src/kmers.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+    std::string random_sequence(std::mt19937 &rng, size_t length) {
+        std::string alphabet = "ACGTacgtNnX-\x80\xff";
+        std::string ret(length, 'A');
+        for (size_t i = 0; i < length; ++i) {
+            // Use mostly valid nucleotides so that the invalid ones appear at various positions.
+            ret[i] = alphabet[rng() % 10 ? rng() % 8 : rng() % alphabet.size()];
+        }
+        return ret;
+    }
+
+    TEST(KMERS, REVERSE_COMPLEMENT_STRING) {
+        struct test_case {
+            std::string input;
+            std::string want_result;
+        };
+        std::vector<test_case> tests = {
+                {"", ""},
+                {"ACGT", "ACGT"},
+                {"AAcgN", "NcgTT"},
+                {"ACGTTGCAACGTTGCAACGTTGCAACGTTGCAxACGT", "ACGTNTGCAACGTTGCAACGTTGCAACGTTGCAACGT"},
+        };
+
+        for (auto t: tests) {
+            char* got_result = ReverseComplementString(t.input.data(), t.input.size());
+
+            EXPECT_EQ(std::string(got_result, got_result + t.input.size()), t.want_result);
+            delete[] got_result;
+        }
+    }
+
+    TEST(KMERS, REVERSE_COMPLEMENT_MATCHES_SCALAR) {
+        std::mt19937 rng(42);
+        for (size_t length = 0; length < 200; ++length) {
+            std::string input = random_sequence(rng, length);
+            std::string want_result(length, 0), got_result(length, 0);
+            ReverseComplementScalar(input.data(), want_result.data(), length);
+
+            ReverseComplement(input.data(), got_result.data(), length);
+            EXPECT_EQ(got_result, want_result);
+#ifdef FMSI_X86_SIMD
+            if (__builtin_cpu_supports("sse4.1")) {
+                ReverseComplementSSE4(input.data(), got_result.data(), length);
+                EXPECT_EQ(got_result, want_result);
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                ReverseComplementAVX2(input.data(), got_result.data(), length);
+                EXPECT_EQ(got_result, want_result);
+            }
+#endif
+        }
+    }
+
+    TEST(KMERS, NEXT_INVALID_NUCLEOTIDE_MATCHES_SCALAR) {
+        std::mt19937 rng(42);
+        for (size_t length = 0; length < 200; ++length) {
+            std::string input = random_sequence(rng, length);
+            size_t want_result = NextInvalidNucleotideScalar(input.data(), length);
+
+            EXPECT_EQ(NextInvalidNucleotide(input.data(), length), want_result);
+#ifdef FMSI_X86_SIMD
+            if (__builtin_cpu_supports("sse4.1")) {
+                EXPECT_EQ(NextInvalidNucleotideSSE4(input.data(), length), want_result);
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                EXPECT_EQ(NextInvalidNucleotideAVX2(input.data(), length), want_result);
+            }
+#endif
+        }
+    }
+
+    TEST(KMERS, CANONICAL_MINIMIZER_POSITIONS) {
+        std::mt19937 rng(42);
+        for (int k : {1, 3, 5, 31}) {
+            for (int w : {1, 2, 4, 10}) {
+                for (size_t length = 0; length < 120; ++length) {
+                    std::string input = random_sequence(rng, length);
+                    auto canonical_hash = [&](size_t position) {
+                        uint64_t forward = 0, reverse = 0;
+                        for (int j = 0; j < k; ++j) {
+                            forward = (forward << 2) | nucleotideToInt[(uint8_t)input[position + j]];
+                            reverse = (reverse << 2) | (3 - nucleotideToInt[(uint8_t)input[position + k - 1 - j]]);
+                        }
+                        return KMerHash(std::min(forward, reverse));
+                    };
+                    // The leftmost k-mer with the smallest hash in each window of each run of valid characters.
+                    std::vector<size_t> want_result;
+                    size_t run_begin = 0;
+                    for (size_t i = 0; i <= length; ++i) {
+                        if (i < length && nucleotideToInt[(uint8_t)input[i]] != 4) continue;
+                        size_t kmers = i - run_begin + 1 > (size_t)k ? i - run_begin - k + 1 : 0;
+                        for (size_t begin = run_begin; kmers && begin + std::min<size_t>(w, kmers) <= run_begin + kmers; ++begin) {
+                            size_t best = begin;
+                            for (size_t position = begin; position < begin + std::min<size_t>(w, kmers); ++position) {
+                                if (canonical_hash(position) < canonical_hash(best)) best = position;
+                            }
+                            if (want_result.empty() || want_result.back() != best) want_result.push_back(best);
+                        }
+                        run_begin = i + 1;
+                    }
+                    std::vector<size_t> got_result;
+
+                    CanonicalMinimizerPositions<uint64_t>(input.data(), length, k, w, got_result);
+
+                    EXPECT_EQ(got_result, want_result);
+                }
+            }
+        }
+    }
+
+    TEST(KMERS, SAMPLED_POSITIONS) {
+        struct test_case {
+            std::string input;
+            int k;
+            int step;
+            std::vector<size_t> want_result;
+        };
+        std::vector<test_case> tests = {
+                {"", 3, 2, {}},
+                {"ACGTACGT", 3, 1, {0, 1, 2, 3, 4, 5}},
+                {"ACGTACGT", 3, 2, {0, 2, 4}},
+                {"ACGTACGT", 3, 4, {0, 4}},
+                {"ACNTACGT", 3, 2, {4}},
+                {"ACNTACGTA", 3, 3, {3, 6}},
+                {"ACGNNNNNN", 3, 2, {0}},
+        };
+
+        for (auto &t : tests) {
+            std::vector<size_t> got_result;
+
+            SampledPositions(t.input.data(), t.input.size(), t.k, t.step, got_result);
+
+            EXPECT_EQ(got_result, t.want_result);
+        }
+    }
+}
@@ -1,7 +1,9 @@
 #include "gtest/gtest.h"
 #include "q_suf_sort_test.h"
 #include "fms_index_test.h"
-//#include "compact_test.h"
+#include "kmers_test.h"
+#include "parser_test.h"
+#include "compact_test.h"
 
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
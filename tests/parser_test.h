@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "../src/parser.h"
+
+#include "gtest/gtest.h"
+
+namespace {
+    /// Read the records with [reader] and return the names and the sequences glued from the windows.
+    /// If [end_result] is given, store the negative result of the last read to it.
+    std::vector<std::pair<std::string, std::string>> read_windows(windowed_reader &reader, size_t window_length, size_t overlap,
+                                                                  int64_t *end_result = nullptr) {
+        std::vector<std::pair<std::string, std::string>> records;
+        int64_t r;
+        while ((r = reader.read()) >= 0) {
+            EXPECT_LE(reader.window_size, std::max(window_length, overlap + 1));
+            std::string window(reader.window, reader.window_size);
+            if (reader.first) {
+                records.emplace_back(reader.name(), window);
+            } else {
+                EXPECT_EQ(records.back().second.substr(records.back().second.size() - overlap), window.substr(0, overlap));
+                records.back().second += window.substr(overlap);
+            }
+        }
+        if (end_result) *end_result = r;
+        return records;
+    }
+
+    /// Read the records of the file content with kseq.
+    std::vector<std::pair<std::string, std::string>> read_windows(const std::string &content, size_t window_length, size_t overlap,
+                                                                  int64_t *end_result = nullptr) {
+        FILE *file = tmpfile();
+        fwrite(content.data(), 1, content.size(), file);
+        rewind(file);
+        gzFile fp = gzdopen(dup(fileno(file)), "r");
+        kseq_t *seq = kseq_init(fp);
+        windowed_reader reader(seq, window_length, overlap);
+        auto records = read_windows(reader, window_length, overlap, end_result);
+        kseq_destroy(seq);
+        gzclose(fp);
+        fclose(file);
+        return records;
+    }
+
+    /// Read the records of the file content in place from a mapped file.
+    std::vector<std::pair<std::string, std::string>> read_mapped_windows(const std::string &content, size_t window_length, size_t overlap,
+                                                                         int64_t *end_result = nullptr) {
+        char path[] = "/tmp/fmsi_parser_testXXXXXX";
+        int fd = mkstemp(path);
+        EXPECT_EQ(write(fd, content.data(), content.size()), (ssize_t) content.size());
+        close(fd);
+        std::vector<std::pair<std::string, std::string>> records;
+        {
+            mapped_file file;
+            EXPECT_TRUE(file.open(path));
+            windowed_reader reader(file, window_length, overlap);
+            records = read_windows(reader, window_length, overlap, end_result);
+        }
+        unlink(path);
+        return records;
+    }
+
+    TEST(PARSER, WINDOWED_READER) {
+        struct test_case {
+            std::string content;
+            std::vector<std::pair<std::string, std::string>> want_result;
+        };
+        std::vector<test_case> tests = {
+                {">a comment\nACGTACGTAC\nGTA\n>b\n\n>c\nAC\n\nGT", {{"a", "ACGTACGTACGTA"}, {"b", ""}, {"c", "ACGT"}}},
+                {"@a\nACGTACGTA\n+\n@@@@@@@@@\n@b c\nACG\nTAC\n+\nIIII\nII\n", {{"a", "ACGTACGTA"}, {"b", "ACGTAC"}}},
+                {">a\r\nACGT\r\nACGT\r\n>b\r\nAC\r\n", {{"a", "ACGTACGT"}, {"b", "AC"}}},
+                {">a x\nACGTACGTAC\n>b\n>c\nACG", {{"a", "ACGTACGTAC"}, {"b", ""}, {"c", "ACG"}}},
+                {"@a\nACGTA\n+\n@@@@@\n@b\nACG\n+\n@@@\n", {{"a", "ACGTA"}, {"b", "ACG"}}},
+                {"", {}},
+        };
+
+        for (auto &t : tests) {
+            for (size_t window_length : {1, 3, 4, 5, 100}) {
+                auto got_result = read_windows(t.content, window_length, 2);
+
+                EXPECT_EQ(got_result, t.want_result);
+                EXPECT_EQ(read_mapped_windows(t.content, window_length, 2), t.want_result);
+            }
+        }
+    }
+
+    TEST(PARSER, WINDOWED_READER_TRUNCATED_QUALITY) {
+        struct test_case {
+            std::string content;
+            int64_t want_result;
+        };
+        std::vector<test_case> tests = {
+                {"@a\nACGTA\n+\n@@@@@\n", -1},
+                {"@a\nACGTA\n+\n@@@\n", -2},
+                {"@a\nACG\nTA\n+\n@@\n@@\n", -2},
+                {"@a\nACGTA\n+\n@@@@@\n@b\nACG\n+", -2},
+        };
+
+        for (auto &t : tests) {
+            for (size_t window_length : {1, 3, 100}) {
+                int64_t got_result = 0, got_mapped_result = 0;
+                read_windows(t.content, window_length, 2, &got_result);
+                read_mapped_windows(t.content, window_length, 2, &got_mapped_result);
+
+                EXPECT_EQ(got_result, t.want_result);
+                EXPECT_EQ(got_mapped_result, t.want_result);
+            }
+        }
+    }
+
+    TEST(PARSER, KMER_LIST_READER) {
+        std::string content = "ACGT\nCGTA id1\r\nGTAC\t id 2\n\nTACG  \nAAAA";
+        std::vector<std::pair<std::string, std::string>> want_result = {
+                {"ACGT", ""}, {"CGTA", "id1"}, {"GTAC", "id 2"}, {"", ""}, {"TACG", ""}, {"AAAA", ""}};
+        char path[] = "/tmp/fmsi_parser_testXXXXXX";
+        int fd = mkstemp(path);
+        ASSERT_EQ(write(fd, content.data(), content.size()), (ssize_t) content.size());
+        close(fd);
+
+        for (bool mapped : {false, true}) {
+            std::vector<std::pair<std::string, std::string>> got_result;
+            mapped_file file;
+            std::string query_fn = path;
+            kseq_t *seq = nullptr;
+            if (mapped) {
+                ASSERT_TRUE(file.open(path));
+            } else {
+                seq = kseq_init(OpenFile(query_fn));
+            }
+            kmer_list_reader reader = mapped ? kmer_list_reader(file) : kmer_list_reader(seq);
+            std::string_view kmer, id;
+            while (reader.read(kmer, id)) {
+                got_result.emplace_back(kmer, id);
+            }
+            if (seq) {
+                gzclose(seq->f->f);
+                kseq_destroy(seq);
+            }
+
+            EXPECT_EQ(got_result, want_result);
+        }
+        unlink(path);
+    }
+
+    TEST(PARSER, PROCESS_BATCHES_IN_PIPELINE) {
+        int next = 0;
+        std::vector<int> got_result;
+
+        process_batches_in_pipeline<std::vector<int>>(
+                [&](std::vector<int> &batch) {
+                    for (int i = 0; i < 3 && next < 100; ++i) batch.push_back(next++);
+                    return !batch.empty();
+                },
+                [&](std::vector<int> &batch) {
+                    got_result.insert(got_result.end(), batch.begin(), batch.end());
+                });
+
+        ASSERT_EQ(got_result.size(), 100);
+        for (int i = 0; i < 100; ++i) {
+            EXPECT_EQ(got_result[i], i);
+        }
+    }
+}